@@ -5,414 +5,4012 @@
 #include <linux/hid.h>
 #include <linux/usb.h>
 #include <linux/init.h>
+#include <linux/kref.h>
 #include <linux/list.h>
 #include <linux/slab.h>
 #include <linux/types.h>
+#include <linux/percpu.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/log2.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/jiffies.h>
+#include <linux/hrtimer.h>
+#include <linux/crc-ccitt.h>
+#include <linux/crc32.h>
+#include <linux/seq_file.h>
+#include <linux/version.h>
+#include <linux/seqlock.h>
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/miscdevice.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/idr.h>
+#include <linux/mm.h>
+#include <linux/fs.h>
 
-static DEFINE_SPINLOCK(report_work_lock);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+#include <linux/unaligned.h>
+#else
+#include <asm/unaligned.h>
+#endif
 
+#include "uapi/g502.h"
 #include "g502.h"
 
+#define CREATE_TRACE_POINTS
+#include "g502_trace.h"
+
+/* One per mouse, shared by both of its USB interfaces. Interface 1 carries
+ * HID++ and owns @cmdq, interface 0 is the mouse itself. Looked up through
+ * the parent usb_device and freed when the last interface goes away. */
 struct logi_g502_data {
-	struct list_head profiles_list;
-	struct g502_profile *profiles[G502_MAX_PROFILES];
-	struct g502_profile *current_prof; /* Pointed by index in @profiles*/
-	struct hidpp_report report;
+	struct list_head entry; /* In g502_devices */
+	struct kref ref;
+	struct usb_device *udev;
+	const struct g502_model *model;
+	struct g502_profile profiles[G502_MAX_PROFILES];
+	int active; /* Index in @profiles of the profile in use */
+	int pending; /* Set by G6 or sysfs, applied by @switch_work, -1 if none */
+	spinlock_t switch_lock; /* Protects @pending and @active updates */
+	struct work_struct switch_work;
+	atomic_t switch_done; /* Switches @switch_work finished, for EPOLLPRI */
+	struct delayed_work config_work; /* Flushes sysfs edits, see g502_config_changed() */
+	unsigned long config_stamp; /* jiffies of the last @config_work run */
+	int config_err; /* What the last @config_work run returned */
+	unsigned int config_retries; /* @config_work runs failed in a row, under @mutex_dev */
+	unsigned int idle_timeout_ms; /* Adaptive report rate, 0 if off */
+	u16 idle_report_rate; /* Hz, used once idle */
+	bool idle; /* Running at @idle_report_rate, set under @mutex_dev */
+	unsigned long idle_stamp; /* jiffies of the last activity */
+	struct delayed_work idle_work;
+	struct work_struct wake_work;
+	bool onboard; /* Profiles live in the mouse's memory, under @mutex_dev */
+	u16 onboard_sector_size;
+	unsigned long onboard_dirty; /* Profiles to upload again, under @mutex_dev */
+	spinlock_t led_lock; /* Protects the @led_* fields below but @led_inflight */
+	struct g502_led_frame led_ring[G502_LED_RING_SIZE];
+	unsigned int led_head; /* Oldest frame in @led_ring */
+	unsigned int led_count;
+	struct g502_led_frame led_last; /* Last frame sent */
+	bool led_last_valid;
+	bool led_running; /* @led_timer is armed */
+	struct hrtimer led_timer;
+	atomic_t led_inflight; /* Commands of the last frame not done yet */
+	struct g502_led_stats led_stats;
+	spinlock_t macro_lock; /* Protects @macros and the player below, writers of @macros also hold @mutex_dev */
+	struct g502_macro_prog *macros[G502_NR_MACROS];
+	const struct g502_macro_prog *macro_prog; /* Playing, NULL if idle */
+	unsigned int macro_pc;
+	u8 macro_queue[G502_MACRO_QUEUE_LEN]; /* Triggers waiting for @macro_prog */
+	unsigned int macro_qhead;
+	unsigned int macro_qcount;
+	DECLARE_BITMAP(macro_keys, KEY_CNT); /* Pressed by the player */
+	struct hrtimer macro_timer;
+	struct g502_macro_stats macro_stats;
+	struct miscdevice misc; /* /dev/g502-N, registered while HID++ is bound */
+	bool misc_registered;
+	int misc_id; /* N, from @g502_ida */
+	struct g502_ring_header *ring; /* vmalloc_user(), mapped by userspace */
+	spinlock_t ring_lock; /* Serializes the writers of @ring */
+	wait_queue_head_t ring_wait;
+	struct work_struct init_work; /* HID++ side of probe, see g502_init_device_work() */
+	struct work_struct resume_work; /* Redoes the config after a USB reset */
+	bool initialized; /* Set once @init_work is done, under @mutex_dev */
+	struct g502_cmdq cmdq;
+	u8 features[G502_F_NR]; /* Indexed by enum g502_feature, 0 if missing */
+	struct g502_dev_state dev_state;
+	struct g502_snapshot snap;
+	seqlock_t state_lock; /* Publishes @dev_state and @snap, writers never sleep */
+	struct input_dev *input_dev; /* Of interface 0, NULL while it's unbound */
+	struct g502_button_map __rcu *btn_map; /* Of the active profile */
+	u16 btn_last; /* Buttons of the previous report */
+	u16 btn_keys; /* Bits we reported a key press for */
+	u16 btn_held[G502_NR_BUTTONS]; /* And the key, in case the map changes meanwhile */
+	spinlock_t dpi_lock; /* Protects @dpi, taken from the event path */
+	struct g502_dpi_state dpi;
+	struct work_struct dpi_work; /* Stores @dpi.stage back in its profile */
+	struct g502_input_stats __percpu *istats;
+	struct dentry *debugfs;
+	struct mutex mutex_dev; /* Serializes the (slow) configuration path */
+	struct mutex state_get_lock; /* Serializes the GETs of g502_state_get() */
+	struct gfirmware gfw[G502_FW_MAX_ENTITIES]; /* By entity index, fixed once @fw_ready */
+	bool fw_ready; /* Discovery filled @gfw in, cleared when HID++ unbinds */
+};
+
+/* hid drvdata of each bound interface */
+struct g502_intf {
+	struct logi_g502_data *gdv;
+	struct hid_device *hdev;
 	struct input_dev *input_dev;
-	struct mutex mutex_dev; /* Protect this struct's shared fields */
-	struct gfirmware gfw;
+	bool mouse; /* Interface 0, the only one whose 8 byte reports are motion */
+};
+
+/* Per mouse state of an open /dev/g502-N */
+struct g502_file {
+	struct logi_g502_data *gdv;
+	u32 poll_head; /* @ring head as of the last poll */
+	u32 poll_switch; /* @switch_done as of the last poll */
+};
+
+static DEFINE_IDA(g502_ida);
+static LIST_HEAD(g502_devices);
+static DEFINE_MUTEX(g502_devices_lock); /* Protects @g502_devices */
+
+static inline struct logi_g502_data *g502_hdev_to_gdv(struct hid_device *hdev)
+{
+	struct g502_intf *gi = hid_get_drvdata(hdev);
+
+	return gi->gdv;
+}
+
+static inline struct g502_profile *g502_active_profile(struct logi_g502_data *gdv)
+{
+	return &gdv->profiles[gdv->active];
+}
+
+/* HID++ commands and replies go through interface 1 */
+static inline bool g502_is_hidpp_intf(struct hid_device *hdev)
+{
+	struct usb_interface *intf = to_usb_interface(hdev->dev.parent);
+
+	return intf->cur_altsetting->desc.bInterfaceNumber == 1;
+}
+
+static __always_inline void
+__do_fill_report(struct hidpp_report *report_ptr,
+			u8 id, u8 feature_index, u8 function_index, size_t report_length, u8 *params)
+{
+	memset(report_ptr, 0, sizeof(*report_ptr));
+	report_ptr->report_id = id;
+	report_ptr->device_index = G502_DEVICE_INDEX_RECEIVER;
+	report_ptr->feature_index = feature_index;
+	report_ptr->funcindex_clientid = function_index; /* SW ID is set by the queue */
+	if (params)
+		memcpy(id == G502_COMMAND_SHORT_REPORT_ID ?
+				report_ptr->params_s : report_ptr->params_l,
+					params, report_length - 4U);
+}
+
+/* What every zone starts with, and software effects use */
+static const struct g502_led_cfg g502_led_fixed = { .mode = G_LED_FIXED };
+
+/* The G502's factory DPI stages */
+static const u16 g502_default_dpi_stages[G502_MAX_DPI_STAGES] = {
+	400, 800, 1600, 2400, 3200
+};
+
+/* @dpi starts at the first default stage it doesn't exceed, and takes
+ * the last one's place if it's above all of them. */
+static __always_inline void
+initalize_profile_struct(struct g502_profile *prof_ptr,
+		u16 report_rate, unsigned int rgb, u16 dpi, int index)
+{
+	int zone, stage;
+
+	prof_ptr->dev_report_rate = report_rate;
+	for (zone = 0; zone < G502_MAX_LED_ZONES; zone++) {
+		prof_ptr->dev_rgb[zone] = rgb;
+		prof_ptr->dev_led[zone] = g502_led_fixed;
+	}
+	memcpy(prof_ptr->dpi_stages, g502_default_dpi_stages,
+			sizeof(prof_ptr->dpi_stages));
+	for (stage = 0; stage < G502_MAX_DPI_STAGES - 1; stage++)
+		if (dpi <= g502_default_dpi_stages[stage])
+			break;
+	prof_ptr->dpi_stages[stage] = dpi;
+	prof_ptr->nr_dpi_stages = G502_MAX_DPI_STAGES;
+	prof_ptr->dpi_stage = stage;
+	prof_ptr->dev_dpi = dpi;
+	prof_ptr->shift_dpi = G502_DPI_SHIFT_DEFAULT;
+	prof_ptr->index	= index;
+}
+
+static struct dentry *g502_debugfs_root;
+
+static bool onboard_profiles;
+module_param(onboard_profiles, bool, 0444);
+MODULE_PARM_DESC(onboard_profiles, "Upload the profiles to the mouse's on-board memory and let its firmware switch them");
+
+static bool sync_writes;
+module_param(sync_writes, bool, 0644);
+MODULE_PARM_DESC(sync_writes, "sysfs config writes wait for the device's ack, instead of being coalesced");
+
+static LIST_HEAD(g502_feature_cache);
+static DEFINE_MUTEX(g502_feature_cache_lock); /* Protects @g502_feature_cache */
+
+static const u16 g502_feature_ids[G502_F_NR] = {
+	[G502_F_ROOT]				= HIDPP_FEATURE_ROOT,
+	[G502_F_DEVICE_FW]			= HIDPP_FEATURE_DEVICE_FW,
+	[G502_F_DPI]				= HIDPP_FEATURE_ADJUSTABLE_DPI,
+	[G502_F_REPORT_RATE]		= HIDPP_FEATURE_REPORT_RATE,
+	[G502_F_COLOR_LED]			= HIDPP_FEATURE_COLOR_LED_EFFECTS,
+	[G502_F_ON_BOARD_PROFILES]	= HIDPP_FEATURE_ONBOARD_PROFILES,
+};
+
+/* Features are used until IRoot tells us otherwise */
+static const struct g502_model g502_models[G502_MODEL_NR] = {
+	[G502_MODEL_G502_HERO] = {
+		.name = "G502 Hero",
+		.max_dpi = G502_MAX_RESOLUTION_DPI,
+		.rate_mask = 0x0f,
+		.nr_led_zones = 2,
+		.flags = G502_MODEL_EXTRA_BUTTONS | G502_MODEL_ONBOARD_5_PROF,
+		.features = {
+			[G502_F_ROOT]				= HIDPP_PAGE_ROOT_IDX,
+			[G502_F_DEVICE_FW]			= G502_FEATURE_DEVICE_FW,
+			[G502_F_DPI]				= G502_FEATURE_DPI,
+			[G502_F_REPORT_RATE]		= G502_FEATURE_REPORT_RATE,
+			[G502_F_COLOR_LED]			= G502_FEATURE_COLOR_LED_EFFECTS,
+			[G502_F_ON_BOARD_PROFILES]	= G502_FEATURE_ON_BOARD_PROFILES,
+		},
+	},
+	[G502_MODEL_G502_SPECTRUM] = {
+		.name = "G502 Proteus Spectrum",
+		.max_dpi = 12000,
+		.rate_mask = 0x0f,
+		.nr_led_zones = 2,
+		.flags = G502_MODEL_EXTRA_BUTTONS | G502_MODEL_ONBOARD_5_PROF,
+	},
+	[G502_MODEL_G403] = {
+		.name = "G403",
+		.max_dpi = 12000,
+		.rate_mask = 0x0f,
+		.nr_led_zones = 2,
+		.flags = G502_MODEL_ONBOARD_5_PROF,
+	},
+	[G502_MODEL_G403_HERO] = {
+		.name = "G403 Hero",
+		.max_dpi = 16000,
+		.rate_mask = 0x0f,
+		.nr_led_zones = 2,
+		.flags = G502_MODEL_ONBOARD_5_PROF,
+	},
+	[G502_MODEL_G_PRO] = {
+		.name = "G Pro",
+		.max_dpi = 12000,
+		.rate_mask = 0x0f,
+		.nr_led_zones = 1,
+		.flags = G502_MODEL_ONBOARD_5_PROF,
+	},
+	[G502_MODEL_G_PRO_HERO] = {
+		.name = "G Pro Hero",
+		.max_dpi = 16000,
+		.rate_mask = 0x0f,
+		.nr_led_zones = 1,
+		.flags = G502_MODEL_ONBOARD_5_PROF,
+	},
+	[G502_MODEL_G203] = {
+		.name = "G203 Prodigy",
+		.max_dpi = 8000,
+		.rate_mask = 0x0f,
+		.nr_led_zones = 1,
+	},
+};
+
+static const char * const g502_fw_type_names[] = {
+	[FW_MAIN_APP]		= "main",
+	[FW_BOOTLOADER]		= "bootloader",
+	[FW_HARDWARE]		= "hardware",
+	[FW_OPT_SENSOR]		= "sensor",
+};
+
+static const char * const g502_feature_names[G502_F_NR + 1] = {
+	[G502_F_ROOT]				= "root",
+	[G502_F_DEVICE_FW]			= "device_fw",
+	[G502_F_DPI]				= "dpi",
+	[G502_F_REPORT_RATE]		= "report_rate",
+	[G502_F_COLOR_LED]			= "color_led",
+	[G502_F_ON_BOARD_PROFILES]	= "on_board_profiles",
+	[G502_F_NR]					= "other",
+};
+
+/* What a HID++ error reply turns into. Transient ones are resent,
+ * the rest fail the command right away. */
+struct g502_hidpp_error {
+	const char *name;
+	int err;
+	bool transient;
+};
+
+static const struct g502_hidpp_error g502_hidpp_errors[G502_HIDPP_ERR_NR] = {
+	[0]										= { "other", -EIO, false },
+	[G502_HIDPP_ERR_UNKNOWN]				= { "unknown", -EIO, true },
+	[G502_HIDPP_ERR_INVALID_ARGUMENT]		= { "invalid_argument", -EINVAL, false },
+	[G502_HIDPP_ERR_OUT_OF_RANGE]			= { "out_of_range", -ERANGE, false },
+	[G502_HIDPP_ERR_HW_ERROR]				= { "hw_error", -EIO, true },
+	[G502_HIDPP_ERR_INTERNAL]				= { "internal", -EIO, true },
+	[G502_HIDPP_ERR_INVALID_FEATURE_INDEX]	= { "invalid_feature_index", -ENXIO, false },
+	[G502_HIDPP_ERR_INVALID_FUNCTION_ID]	= { "invalid_function_id", -EOPNOTSUPP, false },
+	[G502_HIDPP_ERR_BUSY]					= { "busy", -EBUSY, true },
+	[G502_HIDPP_ERR_UNSUPPORTED]			= { "unsupported", -EOPNOTSUPP, false },
+};
+
+/* Maps a feature index back to our own enum, G502_F_NR if unknown.
+ * Only used for accounting, the other direction is a plain lookup. */
+static enum g502_feature g502_feature_from_index(const u8 *features,
+			u8 feature_index)
+{
+	int i;
+
+	if (feature_index == HIDPP_PAGE_ROOT_IDX)
+		return G502_F_ROOT;
+
+	for (i = G502_F_ROOT + 1; i < G502_F_NR; i++)
+		if (features[i] == feature_index)
+			return i;
+
+	return G502_F_NR;
+}
+
+/* IRoot is always there, anything else only if discovery found it */
+static inline bool g502_has_feature(const struct logi_g502_data *gdv,
+			enum g502_feature feature)
+{
+	return feature == G502_F_ROOT || gdv->features[feature];
+}
+
+static inline size_t g502_report_length(const struct hidpp_report *report)
+{
+	return report->report_id == G502_COMMAND_SHORT_REPORT_ID
+				? G502_COMMAND_SHORT_SIZE
+				: G502_COMMAND_LONG_SIZE;
+}
+
+static struct g502_cmd *g502_cmd_alloc(gfp_t gfp)
+{
+	struct g502_cmd *cmd;
+
+	cmd = kzalloc(sizeof(*cmd), gfp);
+	if (!cmd)
+		return NULL;
+
+	INIT_LIST_HEAD(&cmd->entry);
+	kref_init(&cmd->ref);
+	init_completion(&cmd->done);
+	return cmd;
+}
+
+static void g502_cmd_release(struct kref *ref)
+{
+	kfree(container_of(ref, struct g502_cmd, ref));
+}
+
+static inline void g502_cmd_put(struct g502_cmd *cmd)
+{
+	kref_put(&cmd->ref, g502_cmd_release);
+}
+
+/* Must be called with @q->lock held. Returns 0 if no ID is free. */
+static u8 g502_cmdq_get_swid(struct g502_cmdq *q)
+{
+	int i;
+	u8 sw_id;
+
+	for (i = 0; i < G502_SW_ID_MASK; i++) {
+		sw_id = q->next_swid;
+		q->next_swid = sw_id == G502_SW_ID_MASK ? LINUX_KERNEL_SW_ID : sw_id + 1;
+		if (!(q->swid_busy & BIT(sw_id))) {
+			q->swid_busy |= BIT(sw_id);
+			return sw_id;
+		}
+	}
+
+	return 0;
+}
+
+/* Takes @cmd off whichever list it's on. Returns false if somebody else
+ * already finished it. Must be called with @q->lock held. */
+static bool __g502_cmdq_detach(struct g502_cmdq *q, struct g502_cmd *cmd)
+{
+	if (list_empty(&cmd->entry))
+		return false;
+
+	list_del_init(&cmd->entry);
+	if (cmd->sw_id) {
+		q->swid_busy &= ~BIT(cmd->sw_id);
+		q->nr_inflight--;
+	}
+	return true;
+}
+
+/* Account the round trip of @cmd in its feature's histogram. */
+static void g502_cmdq_account(struct g502_cmdq *q, struct g502_cmd *cmd,
+			int status, s64 latency_ns)
+{
+	struct g502_lat_stats *stats;
+	unsigned long flags;
+	u64 us = latency_ns > 0 ? div_u64(latency_ns, NSEC_PER_USEC) : 0;
+
+	stats = &q->stats[g502_feature_from_index(q->features,
+						cmd->report.feature_index)];
+
+	spin_lock_irqsave(&q->lock, flags);
+	if (cmd->replied) {
+		stats->buckets[us ? min_t(u64, ilog2(us), G502_LAT_BUCKETS - 1) : 0]++;
+		stats->replies++;
+		stats->total_us += us;
+		stats->max_us = max(stats->max_us, us);
+	}
+	if (status == -ETIMEDOUT)
+		stats->timeouts++;
+	else if (status)
+		stats->errors++;
+	spin_unlock_irqrestore(&q->lock, flags);
+}
+
+/* Append a record to the event ring. Safe from any context, it never
+ * waits on the readers, who may simply miss records if they're slow. */
+static void g502_ring_add(struct logi_g502_data *gdv, u16 type, u8 feature,
+			u8 function, int status, u32 value, const void *payload, size_t len)
+{
+	struct g502_ring_header *ring = gdv->ring;
+	struct g502_ring_record *rec;
+	unsigned long flags;
+	u32 pos;
+
+	len = min(len, sizeof(rec->payload));
+
+	spin_lock_irqsave(&gdv->ring_lock, flags);
+	pos = ring->head;
+	rec = &g502_ring_records(ring)[pos % G502_RING_NR_RECORDS];
+
+	/* Readers copying this slot will see @seq change under them */
+	WRITE_ONCE(rec->seq, 0);
+	smp_wmb();
+	rec->type = type;
+	rec->len = len;
+	rec->timestamp_ns = ktime_get_ns();
+	rec->feature = feature;
+	rec->function = function;
+	rec->status = status;
+	rec->value = value;
+	memcpy(rec->payload, payload, len);
+	memset(rec->payload + len, 0, sizeof(rec->payload) - len);
+	smp_store_release(&rec->seq, pos + 1);
+	smp_store_release(&ring->head, pos + 1);
+	spin_unlock_irqrestore(&gdv->ring_lock, flags);
+
+	if (wq_has_sleeper(&gdv->ring_wait))
+		wake_up_interruptible(&gdv->ring_wait);
+}
+
+/* Error replies say whether it's worth it, otherwise timeouts and
+ * transfers the USB side dropped are. */
+static bool g502_cmd_transient(const struct g502_cmd *cmd, int status)
+{
+	if (cmd->replied)
+		return g502_hidpp_errors[cmd->hidpp_err].transient;
+	return status != -ENODEV && status != -ESHUTDOWN;
+}
+
+/* Account for how @cmd ended and, if it failed transiently, put it on
+ * @q->retry for a backoff. Returns true if it was, the queue keeps its
+ * reference then. */
+static bool g502_cmd_retry(struct g502_cmdq *q, struct g502_cmd *cmd, int status)
+{
+	struct g502_cmdq_health *health = &q->health;
+	unsigned int delay_ms = 0;
+	unsigned long flags;
+
+	spin_lock_irqsave(&q->lock, flags);
+	if (!status) {
+		if (cmd->retries)
+			health->recovered++;
+		goto out_unlock;
+	}
+
+	if (cmd->replied)
+		health->hidpp[cmd->hidpp_err]++;
+	else if (status == -ETIMEDOUT)
+		health->timeouts++;
+	else if (status != -ENODEV)
+		health->send_errors++;
+
+	if (q->dead || cmd->low_prio || !g502_cmd_transient(cmd, status))
+		goto out_unlock;
+	if (cmd->retries == G502_CMD_MAX_RETRIES) {
+		health->exhausted++;
+		goto out_unlock;
+	}
+
+	delay_ms = min(G502_CMD_RETRY_BASE_MS << cmd->retries, G502_CMD_RETRY_MAX_MS);
+	cmd->retries++;
+	cmd->replied = false;
+	cmd->sw_id = 0;
+	cmd->retry_at = jiffies + msecs_to_jiffies(delay_ms);
+	list_add_tail(&cmd->entry, &q->retry);
+	health->retried++;
+	if (!delayed_work_pending(&q->retry_work) ||
+			time_before(cmd->retry_at, q->retry_next)) {
+		q->retry_next = cmd->retry_at;
+		mod_delayed_work(system_wq, &q->retry_work, msecs_to_jiffies(delay_ms));
+	}
+
+out_unlock:
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	if (delay_ms)
+		hid_dbg(q->hdev, "%s: %02x:%02x failed (%d), resending in %ums\n", __func__,
+				cmd->report.feature_index,
+				cmd->report.funcindex_clientid & G502_FUNCTION_MASK, status, delay_ms);
+	return delay_ms;
+}
+
+/* Hand the result back to the submitter and drop the queue's reference.
+ * @cmd must already be detached. May be called from atomic context. */
+static void g502_cmd_finish(struct g502_cmdq *q, struct g502_cmd *cmd, int status)
+{
+	struct logi_g502_data *gdv = container_of(q, struct logi_g502_data, cmdq);
+	s64 latency_ns;
+
+	if (g502_cmd_retry(q, cmd, status))
+		return;
+
+	latency_ns = ktime_to_ns(ktime_sub(ktime_get(), cmd->submitted));
+	trace_g502_cmd_complete(q->hdev->id, cmd->report.feature_index,
+			cmd->report.funcindex_clientid & G502_FUNCTION_MASK, cmd->sw_id,
+			status, latency_ns);
+	if (status != -ENODEV)
+		g502_cmdq_account(q, cmd, status, latency_ns);
+	g502_ring_add(gdv, G502_REC_CMD, cmd->report.feature_index,
+			cmd->report.funcindex_clientid & G502_FUNCTION_MASK, status,
+			div_u64(latency_ns, NSEC_PER_USEC), &cmd->report,
+			g502_report_length(&cmd->report));
+
+	/* Out of resends on something that may still clear up later,
+	 * whatever it was. See g502_config_retry(). */
+	if (status && cmd->retries == G502_CMD_MAX_RETRIES &&
+			g502_cmd_transient(cmd, status))
+		status = -EAGAIN;
+
+	cmd->status = status;
+	if (cmd->complete)
+		cmd->complete(cmd);
+	complete(&cmd->done);
+	g502_cmd_put(cmd);
+
+	/* A slot in flight was freed, push out whatever is waiting */
+	if (!READ_ONCE(q->dead))
+		queue_work(system_wq, &q->send_work);
+}
+
+static void g502_cmdq_send_work(struct work_struct *work)
+{
+	struct g502_cmdq *q = container_of(work, struct g502_cmdq, send_work);
+	struct g502_cmd *cmd;
+	unsigned long flags;
+	u8 sw_id;
+	int ret;
+
+	for (;;) {
+		spin_lock_irqsave(&q->lock, flags);
+		if (q->dead || q->nr_inflight >= G502_CMD_MAX_INFLIGHT)
+			goto out_unlock;
+
+		if (!list_empty(&q->pending))
+			cmd = list_first_entry(&q->pending, struct g502_cmd, entry);
+		else if (!list_empty(&q->pending_low) &&
+				q->nr_inflight < G502_CMD_MAX_INFLIGHT - 1)
+			cmd = list_first_entry(&q->pending_low, struct g502_cmd, entry);
+		else
+			goto out_unlock;
+
+		sw_id = g502_cmdq_get_swid(q);
+		if (!sw_id)
+			goto out_unlock;
+
+		cmd->sw_id = sw_id;
+		cmd->report.funcindex_clientid =
+			(cmd->report.funcindex_clientid & G502_FUNCTION_MASK) | sw_id;
+		cmd->deadline = jiffies + msecs_to_jiffies(G502_CMD_TIMEOUT_MS);
+		list_move_tail(&cmd->entry, &q->inflight);
+		q->nr_inflight++;
+
+		/* The reply may beat hid_hw_raw_request() back to us */
+		kref_get(&cmd->ref);
+		spin_unlock_irqrestore(&q->lock, flags);
+
+		ret = hid_hw_raw_request(q->hdev, cmd->report.report_id,
+				(u8 *)&cmd->report, g502_report_length(&cmd->report),
+				HID_OUTPUT_REPORT, HID_REQ_SET_REPORT);
+		if (ret < 0) {
+			hid_err(q->hdev,
+				"%s: cannot issue hid raw request (%d)\n", __func__, ret);
+
+			spin_lock_irqsave(&q->lock, flags);
+			if (!__g502_cmdq_detach(q, cmd))
+				ret = 0;
+			spin_unlock_irqrestore(&q->lock, flags);
+			if (ret)
+				g502_cmd_finish(q, cmd, ret);
+		} else {
+			schedule_delayed_work(&q->timeout_work,
+					msecs_to_jiffies(G502_CMD_TIMEOUT_MS));
+		}
+
+		g502_cmd_put(cmd);
+	}
+
+out_unlock:
+	spin_unlock_irqrestore(&q->lock, flags);
+}
+
+/* Fail every command that outlived its deadline, so a waiter never
+ * hangs on a reply the device dropped. */
+static void g502_cmdq_timeout_work(struct work_struct *work)
+{
+	struct g502_cmdq *q = container_of(to_delayed_work(work),
+							struct g502_cmdq, timeout_work);
+	struct g502_cmd *cmd, *tmp;
+	unsigned long flags;
+	LIST_HEAD(expired);
+
+	spin_lock_irqsave(&q->lock, flags);
+	list_for_each_entry_safe(cmd, tmp, &q->inflight, entry) {
+		if (time_before(jiffies, cmd->deadline))
+			continue;
+		__g502_cmdq_detach(q, cmd);
+		list_add_tail(&cmd->entry, &expired);
+	}
+	if (!list_empty(&q->inflight) && !q->dead)
+		schedule_delayed_work(&q->timeout_work,
+				msecs_to_jiffies(G502_CMD_TIMEOUT_MS));
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	list_for_each_entry_safe(cmd, tmp, &expired, entry) {
+		list_del_init(&cmd->entry);
+		hid_dbg(q->hdev, "%s: no reply for %02x:%02x\n", __func__,
+				cmd->report.feature_index, cmd->report.funcindex_clientid);
+		g502_cmd_finish(q, cmd, -ETIMEDOUT);
+	}
+}
+
+/* Resend whatever waited out its backoff, ahead of everything else */
+static void g502_cmdq_retry_work(struct work_struct *work)
+{
+	struct g502_cmdq *q = container_of(to_delayed_work(work),
+							struct g502_cmdq, retry_work);
+	struct g502_cmd *cmd, *tmp;
+	unsigned long flags, now;
+	bool more = false;
+	LIST_HEAD(due);
+
+	spin_lock_irqsave(&q->lock, flags);
+	now = jiffies;
+	list_for_each_entry_safe(cmd, tmp, &q->retry, entry) {
+		if (time_after_eq(now, cmd->retry_at)) {
+			list_move_tail(&cmd->entry, &due);
+		} else if (!more || time_before(cmd->retry_at, q->retry_next)) {
+			q->retry_next = cmd->retry_at;
+			more = true;
+		}
+	}
+	list_splice(&due, &q->pending);
+	if (more && !q->dead)
+		schedule_delayed_work(&q->retry_work, q->retry_next - now);
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	queue_work(system_wq, &q->send_work);
+}
+
+/* The queue starts out stopped, until the HID++ interface shows up */
+static void g502_cmdq_init(struct g502_cmdq *q, const u8 *features)
+{
+	spin_lock_init(&q->lock);
+	INIT_LIST_HEAD(&q->pending);
+	INIT_LIST_HEAD(&q->pending_low);
+	INIT_LIST_HEAD(&q->inflight);
+	INIT_WORK(&q->send_work, g502_cmdq_send_work);
+	INIT_DELAYED_WORK(&q->timeout_work, g502_cmdq_timeout_work);
+	INIT_LIST_HEAD(&q->retry);
+	INIT_DELAYED_WORK(&q->retry_work, g502_cmdq_retry_work);
+	q->next_swid = LINUX_KERNEL_SW_ID;
+	q->features = features;
+	q->dead = true;
+}
+
+static void g502_cmdq_start(struct g502_cmdq *q, struct hid_device *hdev)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&q->lock, flags);
+	WRITE_ONCE(q->hdev, hdev);
+	q->dead = false;
+	spin_unlock_irqrestore(&q->lock, flags);
+}
+
+/* Stop accepting commands and fail everything still queued or in flight. */
+static void g502_cmdq_stop(struct g502_cmdq *q)
+{
+	struct g502_cmd *cmd, *tmp;
+	unsigned long flags;
+	LIST_HEAD(dead);
+
+	spin_lock_irqsave(&q->lock, flags);
+	q->dead = true;
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	cancel_delayed_work_sync(&q->retry_work);
+	cancel_work_sync(&q->send_work);
+	cancel_delayed_work_sync(&q->timeout_work);
+
+	spin_lock_irqsave(&q->lock, flags);
+	list_splice_init(&q->retry, &dead);
+	list_splice_init(&q->pending, &dead);
+	list_splice_init(&q->pending_low, &dead);
+	list_for_each_entry_safe(cmd, tmp, &q->inflight, entry) {
+		__g502_cmdq_detach(q, cmd);
+		list_add_tail(&cmd->entry, &dead);
+	}
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	list_for_each_entry_safe(cmd, tmp, &dead, entry) {
+		list_del_init(&cmd->entry);
+		g502_cmd_finish(q, cmd, -ENODEV);
+	}
+}
+
+/* Queue @cmd for sending. The queue takes its own reference, so the
+ * caller may keep (and later put) theirs to wait on @cmd->done. */
+static int g502_cmd_submit(struct g502_cmdq *q, struct g502_cmd *cmd)
+{
+	unsigned long flags;
+
+	cmd->sw_id = 0;
+	cmd->status = 0;
+	cmd->replied = false;
+	cmd->hidpp_err = 0;
+	cmd->retries = 0;
+	cmd->submitted = ktime_get();
+	reinit_completion(&cmd->done);
+
+	spin_lock_irqsave(&q->lock, flags);
+	if (q->dead) {
+		spin_unlock_irqrestore(&q->lock, flags);
+		return -ENODEV;
+	}
+	trace_g502_cmd_submit(q->hdev->id, cmd->report.feature_index,
+			cmd->report.funcindex_clientid & G502_FUNCTION_MASK);
+	kref_get(&cmd->ref);
+	list_add_tail(&cmd->entry, cmd->low_prio ? &q->pending_low : &q->pending);
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	queue_work(system_wq, &q->send_work);
+	return 0;
+}
+
+/* Look up the command @response answers and take it off the in-flight list.
+ * Replies we have nothing in flight for are stale (timed out already) or
+ * unsolicited, and NULL is returned for those. */
+static struct g502_cmd *g502_cmdq_match(struct g502_cmdq *q,
+			const struct hidpp_report *response, int size, int *status)
+{
+	struct g502_cmd *cmd, *found = NULL;
+	unsigned long flags;
+	u8 feature_index = response->feature_index;
+	u8 funcindex_clientid = response->funcindex_clientid;
+	u8 hidpp_err = 0;
+
+	*status = 0;
+	if (feature_index == G502_FEATURE_ERROR) {
+		feature_index = response->params_s[0];
+		funcindex_clientid = response->params_s[1];
+		hidpp_err = response->params_s[2];
+		if (hidpp_err >= G502_HIDPP_ERR_NR)
+			hidpp_err = 0;
+		*status = g502_hidpp_errors[hidpp_err].err;
+	}
+
+	if (!(funcindex_clientid & G502_SW_ID_MASK))
+		return NULL;
+
+	spin_lock_irqsave(&q->lock, flags);
+	list_for_each_entry(cmd, &q->inflight, entry) {
+		if (cmd->report.feature_index == feature_index &&
+				cmd->report.funcindex_clientid == funcindex_clientid) {
+			found = cmd;
+			__g502_cmdq_detach(q, cmd);
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	if (found) {
+		memcpy(&found->response, response,
+				min_t(size_t, size, sizeof(found->response)));
+		found->replied = true;
+		found->hidpp_err = hidpp_err;
+	}
+	return found;
+}
+
+/* Fire-and-forget send. @done, if set, is called once the reply arrives
+ * or the command fails, with @cmd->context pointing to @gdv. */
+static int g502_send_report(struct logi_g502_data *gdv,
+			const struct hidpp_report *report, g502_cmd_done_t done)
+{
+	struct g502_cmd *cmd;
+	int ret;
+
+	cmd = g502_cmd_alloc(GFP_KERNEL);
+	if (!cmd)
+		return -ENOMEM;
+
+	cmd->report = *report;
+	cmd->complete = done;
+	cmd->context = gdv;
+	ret = g502_cmd_submit(&gdv->cmdq, cmd);
+	g502_cmd_put(cmd);
+	return ret;
+}
+
+/* Send @report and sleep until the device replies or the command times out.
+ * The reply is copied to @response if it isn't NULL. */
+static int g502_send_report_sync(struct logi_g502_data *gdv,
+			const struct hidpp_report *report, struct hidpp_report *response)
+{
+	struct g502_cmd *cmd;
+	int ret;
+
+	cmd = g502_cmd_alloc(GFP_KERNEL);
+	if (!cmd)
+		return -ENOMEM;
+
+	cmd->report = *report;
+	cmd->context = gdv;
+	ret = g502_cmd_submit(&gdv->cmdq, cmd);
+	if (!ret) {
+		wait_for_completion(&cmd->done);
+		ret = cmd->status;
+		if (!ret && response)
+			*response = cmd->response;
+	}
+
+	g502_cmd_put(cmd);
+	return ret;
+}
+
+/* Like g502_send_report_sync(), but @done takes the reply and the wait
+ * is bounded by @timeout_ms and fatal signals. A caller giving up leaves
+ * the command to finish (and @done to run) on its own. */
+static int g502_send_report_timeout(struct logi_g502_data *gdv,
+			const struct hidpp_report *report, g502_cmd_done_t done,
+			unsigned int timeout_ms)
+{
+	struct g502_cmd *cmd;
+	long left;
+	int ret;
+
+	cmd = g502_cmd_alloc(GFP_KERNEL);
+	if (!cmd)
+		return -ENOMEM;
+
+	cmd->report = *report;
+	cmd->complete = done;
+	cmd->context = gdv;
+	ret = g502_cmd_submit(&gdv->cmdq, cmd);
+	if (!ret) {
+		left = wait_for_completion_killable_timeout(&cmd->done,
+				msecs_to_jiffies(timeout_ms));
+		if (left > 0)
+			ret = cmd->status;
+		else
+			ret = left ? left : -ETIMEDOUT;
+	}
+
+	g502_cmd_put(cmd);
+	return ret;
+}
+
+static void g502_txn_init(struct g502_txn *txn, struct logi_g502_data *gdv,
+			gfp_t gfp)
+{
+	txn->gdv = gdv;
+	txn->nr_cmds = 0;
+	txn->nr_sent = 0;
+	txn->gfp = gfp;
+	txn->low_prio = false;
+}
+
+static int g502_txn_add(struct g502_txn *txn, const struct hidpp_report *report,
+			g502_cmd_done_t done)
+{
+	struct g502_cmd *cmd;
+
+	if (txn->nr_cmds == G502_TXN_MAX_CMDS)
+		return -ENOSPC;
+
+	cmd = g502_cmd_alloc(txn->gfp);
+	if (!cmd)
+		return -ENOMEM;
+
+	cmd->report = *report;
+	cmd->complete = done;
+	cmd->context = txn->gdv;
+	cmd->low_prio = txn->low_prio;
+	txn->cmds[txn->nr_cmds++] = cmd;
+	return 0;
+}
+
+static void g502_txn_abort(struct g502_txn *txn)
+{
+	while (txn->nr_cmds)
+		g502_cmd_put(txn->cmds[--txn->nr_cmds]);
+}
+
+/* Submit every command and wait for all of them. Returns the first error. */
+static int g502_txn_commit(struct g502_txn *txn)
+{
+	bool sent[G502_TXN_MAX_CMDS];
+	unsigned int i;
+	int ret, err = 0;
+
+	for (i = 0; i < txn->nr_cmds; i++) {
+		ret = g502_cmd_submit(&txn->gdv->cmdq, txn->cmds[i]);
+		sent[i] = !ret;
+		if (ret && !err)
+			err = ret;
+	}
+
+	for (i = 0; i < txn->nr_cmds; i++) {
+		if (sent[i]) {
+			wait_for_completion(&txn->cmds[i]->done);
+			if (txn->cmds[i]->status && !err)
+				err = txn->cmds[i]->status;
+		}
+	}
+
+	g502_txn_abort(txn);
+	return err;
+}
+
+/* Submit every command without waiting, acks are still accounted for
+ * by the commands' callbacks. Safe from atomic context with GFP_ATOMIC. */
+static int g502_txn_commit_nowait(struct g502_txn *txn)
+{
+	unsigned int i;
+	int ret, err = 0;
+
+	txn->nr_sent = 0;
+	for (i = 0; i < txn->nr_cmds; i++) {
+		ret = g502_cmd_submit(&txn->gdv->cmdq, txn->cmds[i]);
+		if (!ret)
+			txn->nr_sent++;
+		else if (!err)
+			err = ret;
+	}
+
+	g502_txn_abort(txn);
+	return err;
+}
+
+/* Record a value the device confirmed, or forget it if the command failed,
+ * so that the next diff sends it again. */
+static void g502_state_update(struct logi_g502_data *gdv, unsigned long field,
+			unsigned int value, int status)
+{
+	unsigned long flags;
+
+	write_seqlock_irqsave(&gdv->state_lock, flags);
+	if (status) {
+		gdv->dev_state.valid &= ~field;
+	} else {
+		if (field == G502_STATE_REPORT_RATE)
+			gdv->dev_state.report_rate = value;
+		else if (field == G502_STATE_DPI)
+			gdv->dev_state.dpi = value;
+		gdv->dev_state.valid |= field;
+		gdv->dev_state.stamp[__ffs(field)] = jiffies;
+	}
+	write_sequnlock_irqrestore(&gdv->state_lock, flags);
+}
+
+/* Same for a LED zone, whose state is the whole effect it was set to */
+static void g502_state_update_led(struct logi_g502_data *gdv, int zone,
+			const u8 *effect, int status)
+{
+	unsigned long field = G502_STATE_RGB(zone);
+	unsigned long flags;
+
+	write_seqlock_irqsave(&gdv->state_lock, flags);
+	if (status) {
+		gdv->dev_state.valid &= ~field;
+	} else {
+		memcpy(gdv->dev_state.led[zone], effect, G502_LED_EFFECT_SIZE);
+		gdv->dev_state.valid |= field;
+		gdv->dev_state.stamp[__ffs(field)] = jiffies;
+	}
+	write_sequnlock_irqrestore(&gdv->state_lock, flags);
+}
+
+/* Lock-free read of the confirmed state and/or the active profile. */
+static void g502_state_read(struct logi_g502_data *gdv,
+			struct g502_dev_state *state, struct g502_snapshot *snap)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&gdv->state_lock);
+		if (state)
+			*state = gdv->dev_state;
+		if (snap)
+			*snap = gdv->snap;
+	} while (read_seqretry(&gdv->state_lock, seq));
+}
+
+/* Publish @prof as the active profile. Call whenever it is switched or edited. */
+static void g502_publish_profile(struct logi_g502_data *gdv,
+			const struct g502_profile *prof)
+{
+	unsigned long flags;
+
+	write_seqlock_irqsave(&gdv->state_lock, flags);
+	gdv->snap.index = prof->index;
+	gdv->snap.report_rate = prof->dev_report_rate;
+	gdv->snap.dpi = prof->dev_dpi;
+	memcpy(gdv->snap.rgb, prof->dev_rgb, sizeof(gdv->snap.rgb));
+	write_sequnlock_irqrestore(&gdv->state_lock, flags);
+
+	/* A held shift stays held, its release sends the new stage */
+	spin_lock_irqsave(&gdv->dpi_lock, flags);
+	gdv->dpi.index = prof->index;
+	gdv->dpi.nr_stages = prof->nr_dpi_stages;
+	gdv->dpi.stage = prof->dpi_stage;
+	memcpy(gdv->dpi.cmds, &prof->cmds[G502_PCMD_DPI_STAGE], sizeof(gdv->dpi.cmds));
+	spin_unlock_irqrestore(&gdv->dpi_lock, flags);
+
+	rcu_assign_pointer(gdv->btn_map, prof->buttons);
+}
+
+/* Reply callbacks. GETs take the value from the reply, SETs count the
+ * ack as confirmation of the value we sent. */
+static void g502_report_rate_get_done(struct g502_cmd *cmd)
+{
+	struct logi_g502_data *gdv = cmd->context;
+
+	/* That's our idle rate, the one to go back to stays */
+	if (READ_ONCE(gdv->idle))
+		return;
+	g502_state_update(gdv, G502_STATE_REPORT_RATE,
+			report_rate_htd(cmd->response.params_l[0]), cmd->status);
+}
+
+static void g502_report_rate_set_done(struct g502_cmd *cmd)
+{
+	g502_state_update(cmd->context, G502_STATE_REPORT_RATE,
+			report_rate_htd(cmd->report.params_s[0]), cmd->status);
+}
+
+static void g502_dpi_get_done(struct g502_cmd *cmd)
+{
+	g502_state_update(cmd->context, G502_STATE_DPI,
+			(u16)(cmd->response.params_l[1] << 8) | cmd->response.params_l[2],
+			cmd->status);
+}
+
+static void g502_dpi_set_done(struct g502_cmd *cmd)
+{
+	g502_state_update(cmd->context, G502_STATE_DPI,
+			(u16)(cmd->report.params_s[1] << 8) | cmd->report.params_s[2],
+			cmd->status);
+}
+
+static void g502_rgb_set_done(struct g502_cmd *cmd)
+{
+	const u8 *params = cmd->report.params_l;
+
+	g502_state_update_led(cmd->context, params[0], &params[1], cmd->status);
+}
+
+/* A fixed or breathing zone without a colour is left as the device has it */
+static inline bool g502_led_unset(const struct g502_led_cfg *cfg, unsigned int rgb)
+{
+	return !rgb && (cfg->mode == G_LED_FIXED || cfg->mode == G_LED_BREATHING);
+}
+
+/* The G502_LED_EFFECT_SIZE bytes of an effect, as setZoneEffect takes
+ * them after the zone and the on-board profiles store them. */
+static void g502_led_effect_encode(u8 *effect, const struct g502_led_cfg *cfg,
+			unsigned int hrgb)
+{
+	RGB rgb = rgb_to_struct_rgb(hrgb);
+	unsigned int brightness = cfg->brightness ?: 100;
+	u16 period = cfg->period_ms ?: G502_LED_PERIOD_DEFAULT_MS;
+
+	memset(effect, 0, G502_LED_EFFECT_SIZE);
+	switch (cfg->mode) {
+	case G_LED_OFF:
+		effect[0] = G502_LED_EFFECT_OFF;
+		break;
+	case G_LED_FIXED:
+		effect[0] = G502_LED_EFFECT_FIXED;
+		effect[1] = rgb.r * brightness / 100;
+		effect[2] = rgb.g * brightness / 100;
+		effect[3] = rgb.b * brightness / 100;
+		break;
+	case G_LED_BREATHING:
+		effect[0] = G502_LED_EFFECT_BREATHING;
+		effect[1] = rgb.r;
+		effect[2] = rgb.g;
+		effect[3] = rgb.b;
+		put_unaligned_be16(period, &effect[4]);
+		effect[7] = brightness; /* After the waveform, 0 is the default one */
+		break;
+	case G_LED_CYCLE:
+		effect[0] = G502_LED_EFFECT_CYCLE;
+		put_unaligned_be16(period, &effect[6]);
+		effect[8] = brightness;
+		break;
+	}
+}
+
+/* 0x8070 setZoneEffect: zone, 11 bytes of effect, persistence */
+static void g502_encode_led(struct logi_g502_data *gdv, struct hidpp_report *report,
+			int zone, const struct g502_led_cfg *cfg, unsigned int hrgb)
+{
+	u8 params[G502_COMMAND_LONG_SIZE - 4U] = { 0 };
+
+	params[0] = zone;
+	g502_led_effect_encode(&params[1], cfg, hrgb);
+	params[12] = G502_LED_PERSIST_RAM;
+	__do_fill_report(report, G502_COMMAND_LONG_REPORT_ID,
+						gdv->features[G502_F_COLOR_LED], G502_CHANGE_LED_MODE,
+						G502_COMMAND_LONG_SIZE, params);
+}
+
+/* 0x2201 setSensorDpi: sensor index, DPI (be16) */
+static void g502_encode_dpi(struct logi_g502_data *gdv,
+			struct hidpp_report *report, u16 dpi)
+{
+	u8 params[G502_COMMAND_SHORT_SIZE - 4U] = { 0 };
+
+	params[0] = 0; /* Sensor idx */
+	put_unaligned_be16(dpi, &params[1]);
+	__do_fill_report(report, G502_COMMAND_SHORT_REPORT_ID,
+						gdv->features[G502_F_DPI], G502_SET_DPI,
+						G502_COMMAND_SHORT_SIZE, params);
+}
+
+/* The primary zone's colour dimmed to show @stage, at full brightness
+ * on the last one. */
+static unsigned int g502_dpi_stage_rgb(unsigned int hrgb, int stage, int nr_stages)
+{
+	RGB rgb = rgb_to_struct_rgb(hrgb);
+
+	rgb.r = rgb.r * (stage + 1) / nr_stages;
+	rgb.g = rgb.g * (stage + 1) / nr_stages;
+	rgb.b = rgb.b * (stage + 1) / nr_stages;
+	return (rgb.r << 16) | (rgb.g << 8) | rgb.b;
+}
+
+/* Build the SETs of @prof, so a switch only has to hand them to the
+ * queue. Call with @mutex_dev held whenever @prof or the feature
+ * indexes change. */
+static void g502_encode_profile(struct logi_g502_data *gdv,
+			struct g502_profile *prof)
+{
+	u8 params[G502_COMMAND_LONG_SIZE - 4U] = { 0 };
+	struct hidpp_report *report;
+	int zone, stage;
+
+	/* Whatever is encoded has to be uploaded again in on-board mode */
+	gdv->onboard_dirty |= BIT(prof->index);
+
+	params[0] = report_rate_dth(prof->dev_report_rate);
+	__do_fill_report(&prof->cmds[G502_PCMD_REPORT_RATE], G502_COMMAND_SHORT_REPORT_ID,
+						gdv->features[G502_F_REPORT_RATE], G502_SET_REPORT_RATE,
+						G502_COMMAND_SHORT_SIZE, params);
+
+	g502_encode_dpi(gdv, &prof->cmds[G502_PCMD_DPI], prof->dev_dpi);
+
+	for (zone = 0; zone < G502_MAX_LED_ZONES; zone++) {
+		report = &prof->cmds[G502_PCMD_LED + zone];
+		memset(report, 0, sizeof(*report));
+		if (!g502_led_unset(&prof->dev_led[zone], prof->dev_rgb[zone]))
+			g502_encode_led(gdv, report, zone, &prof->dev_led[zone],
+					prof->dev_rgb[zone]);
+	}
+
+	/* What the DPI buttons send, see g502_dpi_button() */
+	for (stage = 0; stage < G502_MAX_DPI_STAGES; stage++) {
+		g502_encode_dpi(gdv, &prof->cmds[G502_PCMD_DPI_STAGE + stage],
+				prof->dpi_stages[stage]);
+
+		report = &prof->cmds[G502_PCMD_DPI_LED + stage];
+		memset(report, 0, sizeof(*report));
+		if (stage < prof->nr_dpi_stages && prof->dev_rgb[G_LED_PRIMARY] &&
+				prof->dev_led[G_LED_PRIMARY].mode == G_LED_FIXED &&
+				gdv->model->nr_led_zones)
+			g502_encode_led(gdv, report, G_LED_PRIMARY, &prof->dev_led[G_LED_PRIMARY],
+					g502_dpi_stage_rgb(prof->dev_rgb[G_LED_PRIMARY],
+						stage, prof->nr_dpi_stages));
+	}
+
+	report = &prof->cmds[G502_PCMD_DPI_SHIFT];
+	memset(report, 0, sizeof(*report));
+	if (prof->shift_dpi)
+		g502_encode_dpi(gdv, report, prof->shift_dpi);
+}
+
+static void g502_encode_profiles(struct logi_g502_data *gdv)
+{
+	int i;
+
+	for (i = 0; i < G502_MAX_PROFILES; i++)
+		g502_encode_profile(gdv, &gdv->profiles[i]);
+}
+
+/* Add a SET for every field of @target that differs from what the
+ * device last confirmed. Unknown fields are always sent. */
+static int g502_txn_diff_profile(struct g502_txn *txn,
+			const struct g502_profile *target)
+{
+	struct logi_g502_data *gdv = txn->gdv;
+	const struct hidpp_report *led;
+	struct g502_dev_state state;
+	unsigned long flags;
+	bool shifted;
+	int zone, ret;
+
+	g502_state_read(gdv, &state, NULL);
+	spin_lock_irqsave(&gdv->dpi_lock, flags);
+	shifted = gdv->dpi.shifted;
+	spin_unlock_irqrestore(&gdv->dpi_lock, flags);
+
+	if (target->dev_report_rate && g502_has_feature(gdv, G502_F_REPORT_RATE) &&
+		(!(state.valid & G502_STATE_REPORT_RATE) ||
+			state.report_rate != target->dev_report_rate))
+	{
+		ret = g502_txn_add(txn, &target->cmds[G502_PCMD_REPORT_RATE],
+				g502_report_rate_set_done);
+		if (ret)
+			return ret;
+	}
+
+	/* The shift button owns the DPI while held, its release sends the stage */
+	if (target->dev_dpi && g502_has_feature(gdv, G502_F_DPI) && !shifted &&
+		(!(state.valid & G502_STATE_DPI) || state.dpi != target->dev_dpi))
+	{
+		ret = g502_txn_add(txn, &target->cmds[G502_PCMD_DPI],
+				g502_dpi_set_done);
+		if (ret)
+			return ret;
+	}
+
+	for (zone = 0; zone < gdv->model->nr_led_zones &&
+			g502_has_feature(gdv, G502_F_COLOR_LED); zone++) {
+		led = &target->cmds[G502_PCMD_LED + zone];
+		/* The DPI LED shows the stage */
+		if (zone == G_LED_PRIMARY &&
+				target->cmds[G502_PCMD_DPI_LED + target->dpi_stage].report_id)
+			led = &target->cmds[G502_PCMD_DPI_LED + target->dpi_stage];
+
+		/* The effect is compared as encoded, one long report per zone at most */
+		if (!led->report_id || ((state.valid & G502_STATE_RGB(zone)) &&
+				!memcmp(state.led[zone], &led->params_l[1], G502_LED_EFFECT_SIZE)))
+			continue;
+
+		ret = g502_txn_add(txn, led, g502_rgb_set_done);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static void g502_root_get_feature_done(struct g502_cmd *cmd)
+{
+	struct logi_g502_data *gdv = cmd->context;
+	u16 feature_id = get_unaligned_be16(cmd->report.params_s);
+	int i;
+
+	if (cmd->status)
+		return;
+
+	for (i = G502_F_ROOT + 1; i < G502_F_NR; i++) {
+		if (g502_feature_ids[i] == feature_id) {
+			/* Index 0 means the device doesn't have it */
+			gdv->features[i] = cmd->response.params_l[0];
+			return;
+		}
+	}
+}
+
+static void g502_fw_info_done(struct g502_cmd *cmd)
+{
+	struct logi_g502_data *gdv = cmd->context;
+	const u8 *info = cmd->response.params_l;
+	struct gfirmware *fw;
+
+	if (cmd->status)
+		return;
+
+	fw = &gdv->gfw[cmd->report.params_s[0]];
+	fw->ftype = info[0];
+	memcpy(fw->name, &info[1], 3);
+	fw->name[3] = '\0';
+	fw->version = info[4];
+	fw->revision = info[5];
+	fw->build = get_unaligned_be16(&info[6]);
+	fw->valid = true;
+}
+
+/* Ask for the entity count, then query all of them at once. Asking past
+ * the last one gets error replies, which would count as failures. */
+static void g502_query_firmware(struct logi_g502_data *gdv)
+{
+	u8 params[G502_COMMAND_LONG_SIZE - 4U] = { 0 };
+	struct hidpp_report report, response;
+	struct g502_txn txn;
+	int i, count;
+
+	memset(gdv->gfw, 0, sizeof(gdv->gfw));
+	if (!g502_has_feature(gdv, G502_F_DEVICE_FW))
+		return;
+
+	__do_fill_report(&report, G502_COMMAND_SHORT_REPORT_ID,
+					gdv->features[G502_F_DEVICE_FW], G502_GET_FW_COUNT,
+					G502_COMMAND_SHORT_SIZE, NULL);
+	if (g502_send_report_sync(gdv, &report, &response))
+		return;
+	count = min_t(int, response.params_l[0], G502_FW_MAX_ENTITIES);
+
+	g502_txn_init(&txn, gdv, GFP_KERNEL);
+	for (i = 0; i < count; i++) {
+		params[0] = i;
+		__do_fill_report(&report, G502_COMMAND_SHORT_REPORT_ID,
+						gdv->features[G502_F_DEVICE_FW], G502_GET_FW_INFO,
+						G502_COMMAND_SHORT_SIZE, params);
+		if (g502_txn_add(&txn, &report, g502_fw_info_done)) {
+			g502_txn_abort(&txn);
+			return;
+		}
+	}
+
+	/* The done callback only keeps what the device answered */
+	g502_txn_commit(&txn);
+}
+
+/* Resolve every feature we use to its index on this device, then the
+ * firmware. Each step is one transaction, and the result is
+ * cached for the product/firmware pair so a replug doesn't redo it. */
+static int g502_discover_features(struct logi_g502_data *gdv)
+{
+	u16 product = le16_to_cpu(gdv->udev->descriptor.idProduct);
+	u16 bcd_device = le16_to_cpu(gdv->udev->descriptor.bcdDevice);
+	u8 params[G502_COMMAND_LONG_SIZE - 4U] = { 0 };
+	struct g502_feature_cache *entry;
+	struct hidpp_report report;
+	struct g502_txn txn;
+	int i, ret;
+
+	mutex_lock(&g502_feature_cache_lock);
+	list_for_each_entry(entry, &g502_feature_cache, entry) {
+		if (entry->product == product && entry->bcd_device == bcd_device) {
+			memcpy(gdv->features, entry->features, sizeof(gdv->features));
+			memcpy(gdv->gfw, entry->gfw, sizeof(gdv->gfw));
+			mutex_unlock(&g502_feature_cache_lock);
+			return 0;
+		}
+	}
+	mutex_unlock(&g502_feature_cache_lock);
+
+	g502_txn_init(&txn, gdv, GFP_KERNEL);
+	for (i = G502_F_ROOT + 1; i < G502_F_NR; i++) {
+		put_unaligned_be16(g502_feature_ids[i], params);
+		__do_fill_report(&report, G502_COMMAND_SHORT_REPORT_ID,
+						HIDPP_PAGE_ROOT_IDX, CMD_ROOT_GET_FEATURE,
+						G502_COMMAND_SHORT_SIZE, params);
+		ret = g502_txn_add(&txn, &report, g502_root_get_feature_done);
+		if (ret) {
+			g502_txn_abort(&txn);
+			return ret;
+		}
+	}
+
+	ret = g502_txn_commit(&txn);
+	if (ret) {
+		/* Keep the defaults, but don't cache a half resolved table */
+		memcpy(gdv->features, gdv->model->features, sizeof(gdv->features));
+		g502_query_firmware(gdv);
+		return ret;
+	}
+
+	g502_query_firmware(gdv);
+
+	entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+	if (!entry)
+		return 0;
+
+	entry->product = product;
+	entry->bcd_device = bcd_device;
+	memcpy(entry->features, gdv->features, sizeof(entry->features));
+	memcpy(entry->gfw, gdv->gfw, sizeof(entry->gfw));
+
+	mutex_lock(&g502_feature_cache_lock);
+	list_add(&entry->entry, &g502_feature_cache);
+	mutex_unlock(&g502_feature_cache_lock);
+	return 0;
+}
+
+static void g502_feature_cache_free(void)
+{
+	struct g502_feature_cache *entry, *tmp;
+
+	mutex_lock(&g502_feature_cache_lock);
+	list_for_each_entry_safe(entry, tmp, &g502_feature_cache, entry) {
+		list_del(&entry->entry);
+		kfree(entry);
+	}
+	mutex_unlock(&g502_feature_cache_lock);
+}
+
+/* Sends out command to get the current device's config to be caught
+ * in raw_event and be stored as the device's confirmed state.
+ */
+static int g502_refresh_gdv_config(struct logi_g502_data *gdv)
+{
+	struct hidpp_report report;
+	struct g502_txn txn;
+	int ret;
+
+	/* Both GETs are in flight together */
+	g502_txn_init(&txn, gdv, GFP_KERNEL);
+	if (g502_has_feature(gdv, G502_F_REPORT_RATE)) {
+		__do_fill_report(&report, G502_COMMAND_SHORT_REPORT_ID,
+			gdv->features[G502_F_REPORT_RATE], G502_GET_REPORT_RATE,
+			G502_COMMAND_SHORT_SIZE, NULL);
+		ret = g502_txn_add(&txn, &report, g502_report_rate_get_done);
+		if (ret)
+			goto out_abort;
+	}
+
+	if (g502_has_feature(gdv, G502_F_DPI)) {
+		__do_fill_report(&report, G502_COMMAND_SHORT_REPORT_ID,
+			gdv->features[G502_F_DPI], G502_GET_DPI, G502_COMMAND_SHORT_SIZE, NULL);
+		ret = g502_txn_add(&txn, &report, g502_dpi_get_done);
+		if (ret)
+			goto out_abort;
+	}
+
+	/* TODO: Add RGB */
+	return g502_txn_commit(&txn);
+
+out_abort:
+	g502_txn_abort(&txn);
+	return ret;
+}
+
+static bool g502_state_fresh(const struct g502_dev_state *state, unsigned long field)
+{
+	return (state->valid & field) &&
+		time_before(jiffies, state->stamp[__ffs(field)] +
+				msecs_to_jiffies(G502_STATE_CACHE_MS));
+}
+
+/* The confirmed value of @field (report rate or DPI), asking the device
+ * only if the last confirmation is older than G502_STATE_CACHE_MS. SET
+ * acks count, so a config change refreshes it too. Readers queue up on
+ * @state_get_lock and the ones behind the first get its answer. */
+static int g502_state_get(struct logi_g502_data *gdv, unsigned long field,
+			unsigned int *value)
+{
+	struct g502_dev_state state;
+	struct g502_snapshot snap;
+	struct hidpp_report report;
+	g502_cmd_done_t done;
+	enum g502_feature feature;
+	u8 function;
+	int ret = 0;
+
+	if (field == G502_STATE_REPORT_RATE) {
+		feature = G502_F_REPORT_RATE;
+		function = G502_GET_REPORT_RATE;
+		done = g502_report_rate_get_done;
+	} else if (field == G502_STATE_DPI) {
+		feature = G502_F_DPI;
+		function = G502_GET_DPI;
+		done = g502_dpi_get_done;
+	} else {
+		return -EINVAL;
+	}
+
+	if (!g502_has_feature(gdv, feature))
+		return -EOPNOTSUPP;
+
+	g502_state_read(gdv, &state, &snap);
+	/* Feature indexes aren't resolved before @init_work is done, show
+	 * what's about to be applied instead of asking the wrong index */
+	if (!READ_ONCE(gdv->initialized)) {
+		if (state.valid & field)
+			goto out_value;
+		*value = field == G502_STATE_REPORT_RATE ? snap.report_rate : snap.dpi;
+		return 0;
+	}
+
+	/* While idle the device runs at our rate, not at the one to go back to */
+	if (g502_state_fresh(&state, field) ||
+			(field == G502_STATE_REPORT_RATE && READ_ONCE(gdv->idle) &&
+				(state.valid & field)))
+		goto out_value;
+
+	if (mutex_lock_killable(&gdv->state_get_lock))
+		return -EINTR;
+	g502_state_read(gdv, &state, NULL);
+	if (!g502_state_fresh(&state, field)) {
+		__do_fill_report(&report, G502_COMMAND_SHORT_REPORT_ID,
+				gdv->features[feature], function, G502_COMMAND_SHORT_SIZE, NULL);
+		ret = g502_send_report_timeout(gdv, &report, done,
+				G502_STATE_GET_TIMEOUT_MS);
+		g502_state_read(gdv, &state, NULL);
+	}
+	mutex_unlock(&gdv->state_get_lock);
+
+	if (ret)
+		return ret;
+	/* Failed or was forgotten meanwhile, nothing to show */
+	if (!(state.valid & field))
+		return -EIO;
+
+out_value:
+	*value = field == G502_STATE_REPORT_RATE ? state.report_rate : state.dpi;
+	return 0;
+}
+
+/* Put the device on @idle_report_rate without touching the confirmed
+ * state, see g502_idle_work(). Called with @mutex_dev held. */
+static int g502_idle_rate_set(struct logi_g502_data *gdv)
+{
+	u8 params[G502_COMMAND_LONG_SIZE - 4U] = { 0 };
+	struct hidpp_report report;
+
+	params[0] = report_rate_dth(gdv->idle_report_rate);
+	__do_fill_report(&report, G502_COMMAND_SHORT_REPORT_ID,
+					gdv->features[G502_F_REPORT_RATE], G502_SET_REPORT_RATE,
+					G502_COMMAND_SHORT_SIZE, params);
+	return g502_send_report_sync(gdv, &report, NULL);
+}
+
+/* Bring the device in line with @target, sending only what changed since
+ * the last confirmed state. Acks update the state, nothing is read back.
+ * With @wait unset this doesn't sleep, for use from the event path.
+ */
+static int g502_update_device_config(struct logi_g502_data *gdv,
+			const struct g502_profile *target, bool wait)
+{
+	struct g502_dev_state state;
+	struct g502_txn txn;
+	bool rate_sent = false;
+	unsigned int i;
+	int ret;
+
+	g502_txn_init(&txn, gdv, wait ? GFP_KERNEL : GFP_ATOMIC);
+	ret = g502_txn_diff_profile(&txn, target);
+	if (ret) {
+		g502_txn_abort(&txn);
+		return ret;
+	}
+
+	for (i = 0; i < txn.nr_cmds; i++)
+		if (txn.cmds[i]->complete == g502_report_rate_set_done)
+			rate_sent = true;
+
+	ret = wait ? g502_txn_commit(&txn) : g502_txn_commit_nowait(&txn);
+	if (!rate_sent || !wait || !READ_ONCE(gdv->idle))
+		return ret;
+
+	/* The profile's rate went out, but an idle mouse stays at the idle
+	 * rate until there's activity. Failing that, it's awake now. */
+	g502_state_read(gdv, &state, NULL);
+	if (!(state.valid & G502_STATE_REPORT_RATE) ||
+			state.report_rate <= gdv->idle_report_rate ||
+			g502_idle_rate_set(gdv)) {
+		WRITE_ONCE(gdv->idle, false);
+		if (READ_ONCE(gdv->idle_timeout_ms))
+			schedule_delayed_work(&gdv->idle_work,
+					msecs_to_jiffies(READ_ONCE(gdv->idle_timeout_ms)));
+	}
+	return ret;
+}
+
+static int g502_onboard_cmd(struct logi_g502_data *gdv, u8 function,
+			const u8 *params, size_t len, struct hidpp_report *response)
+{
+	u8 buf[G502_COMMAND_LONG_SIZE - 4U] = { 0 };
+	struct hidpp_report report;
+
+	memcpy(buf, params, min(len, sizeof(buf)));
+	__do_fill_report(&report, G502_COMMAND_LONG_REPORT_ID,
+						gdv->features[G502_F_ON_BOARD_PROFILES], function,
+						G502_COMMAND_LONG_SIZE, buf);
+	return g502_send_report_sync(gdv, &report, response);
+}
+
+static bool g502_onboard_crc_ok(const u8 *buf, size_t size)
+{
+	return crc_ccitt_false(0xffff, buf, size - 2) ==
+			get_unaligned_be16(buf + size - 2);
+}
+
+static int g502_onboard_read_sector(struct logi_g502_data *gdv, u16 sector, u8 *buf)
+{
+	u16 size = gdv->onboard_sector_size;
+	struct hidpp_report response;
+	u8 params[4];
+	u16 off, at;
+	int ret;
+
+	for (off = 0; off < size; off += G502_ONBOARD_CHUNK) {
+		/* Reads can't cross the end of the sector, the last one overlaps */
+		at = min_t(u16, off, size - G502_ONBOARD_CHUNK);
+		put_unaligned_be16(sector, &params[0]);
+		put_unaligned_be16(at, &params[2]);
+		ret = g502_onboard_cmd(gdv, G502_MEMORY_READ, params, sizeof(params),
+				&response);
+		if (ret)
+			return ret;
+		memcpy(buf + at, response.params_l, G502_ONBOARD_CHUNK);
+	}
+
+	return 0;
+}
+
+/* Write @buf with its CRC, then read the sector back and check it. */
+static int g502_onboard_write_sector(struct logi_g502_data *gdv, u16 sector, u8 *buf)
+{
+	u16 size = gdv->onboard_sector_size;
+	u8 params[G502_ONBOARD_CHUNK];
+	u16 crc, off;
+	u8 *check;
+	int ret;
+
+	crc = crc_ccitt_false(0xffff, buf, size - 2);
+	put_unaligned_be16(crc, buf + size - 2);
+
+	put_unaligned_be16(sector, &params[0]);
+	put_unaligned_be16(0, &params[2]);
+	put_unaligned_be16(size, &params[4]);
+	ret = g502_onboard_cmd(gdv, G502_MEMORY_ADDR_WRITE, params, 6, NULL);
+	if (ret)
+		return ret;
+
+	for (off = 0; off < size; off += G502_ONBOARD_CHUNK) {
+		memset(params, 0xff, sizeof(params));
+		memcpy(params, buf + off, min_t(u16, G502_ONBOARD_CHUNK, size - off));
+		ret = g502_onboard_cmd(gdv, G502_MEMORY_WRITE, params, sizeof(params), NULL);
+		if (ret)
+			return ret;
+	}
+
+	ret = g502_onboard_cmd(gdv, G502_MEMORY_WRITE_END, NULL, 0, NULL);
+	if (ret)
+		return ret;
+
+	check = kmalloc(size, GFP_KERNEL);
+	if (!check)
+		return -ENOMEM;
+
+	ret = g502_onboard_read_sector(gdv, sector, check);
+	if (!ret && (!g502_onboard_crc_ok(check, size) ||
+			get_unaligned_be16(check + size - 2) != crc))
+		ret = -EIO;
+
+	kfree(check);
+	return ret;
+}
+
+/* Only the fields we manage are patched in, buttons, names and the
+ * rest are kept as they were. */
+static void g502_onboard_encode(struct logi_g502_data *gdv,
+			const struct g502_profile *prof, u8 *buf)
+{
+	int i;
+
+	if (prof->dev_report_rate)
+		buf[G502_OBP_REPORT_RATE] = 1000 / prof->dev_report_rate;
+
+	buf[G502_OBP_DEFAULT_DPI] = prof->dpi_stage;
+	for (i = 0; i < G502_MAX_DPI_STAGES; i++)
+		put_unaligned_le16(i < prof->nr_dpi_stages ? prof->dpi_stages[i] : 0,
+				buf + G502_OBP_DPI + 2 * i);
+
+	BUILD_BUG_ON(G502_OBP_LED_SIZE != G502_LED_EFFECT_SIZE);
+	for (i = 0; i < gdv->model->nr_led_zones; i++)
+		if (!g502_led_unset(&prof->dev_led[i], prof->dev_rgb[i]))
+			g502_led_effect_encode(buf + G502_OBP_LEDS + i * G502_OBP_LED_SIZE,
+					&prof->dev_led[i], prof->dev_rgb[i]);
+}
+
+static int g502_onboard_upload_profile(struct logi_g502_data *gdv,
+			const struct g502_profile *prof)
+{
+	u16 size = gdv->onboard_sector_size;
+	u8 *buf;
+	int ret;
+
+	buf = kmalloc(size, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	/* Start from the current copy, or the factory one if it's garbage */
+	ret = g502_onboard_read_sector(gdv, 1 + prof->index, buf);
+	if (!ret && !g502_onboard_crc_ok(buf, size))
+		ret = g502_onboard_read_sector(gdv,
+				G502_ONBOARD_ROM_SECTOR + prof->index, buf);
+	if (ret)
+		goto out;
+	if (!g502_onboard_crc_ok(buf, size))
+		memset(buf, 0xff, size);
+
+	g502_onboard_encode(gdv, prof, buf);
+	ret = g502_onboard_write_sector(gdv, 1 + prof->index, buf);
+out:
+	kfree(buf);
+	return ret;
+}
+
+/* Upload whatever changed since the last sync and select the active
+ * profile. Called with @mutex_dev held. */
+static int g502_onboard_sync(struct logi_g502_data *gdv)
+{
+	u8 params[2] = { 0, gdv->active + 1 };
+	int i, ret;
+
+	for (i = 0; i < G502_MAX_PROFILES; i++) {
+		if (!(gdv->onboard_dirty & BIT(i)))
+			continue;
+		ret = g502_onboard_upload_profile(gdv, &gdv->profiles[i]);
+		if (ret)
+			return ret;
+		gdv->onboard_dirty &= ~BIT(i);
+	}
+
+	return g502_onboard_cmd(gdv, G502_SET_CURRENT_PROFILE, params,
+			sizeof(params), NULL);
+}
+
+/* Bring the memory up to date and hand the switching to the firmware */
+static int g502_onboard_enable(struct logi_g502_data *gdv)
+{
+	u8 mode = G502_ON_BOARD_PROFILES_ON;
+	int ret;
+
+	ret = g502_onboard_sync(gdv);
+	if (ret)
+		return ret;
+
+	return g502_onboard_cmd(gdv, G502_CONTROL_ON_BOARD_PROFILES, &mode,
+			sizeof(mode), NULL);
+}
+
+/* Check the memory layout, upload all profiles and the directory, then
+ * hand the switching over to the firmware. Called with @mutex_dev held,
+ * on errors the caller falls back to host mode. */
+static int g502_onboard_init(struct logi_g502_data *gdv)
+{
+	struct hidpp_report response;
+	u8 format, count;
+	u16 size;
+	u8 *dir;
+	int i, ret;
+
+	/* The sector offsets are only known for some of the mice */
+	if (!(gdv->model->flags & G502_MODEL_ONBOARD_5_PROF))
+		return -EOPNOTSUPP;
+
+	ret = g502_onboard_cmd(gdv, G502_GET_ON_BOARD_INFO, NULL, 0, &response);
+	if (ret)
+		return ret;
+
+	format = response.params_l[1];
+	count = response.params_l[3];
+	size = get_unaligned_be16(&response.params_l[7]);
+	if (format < G502_ONBOARD_FORMAT_MIN || format > G502_ONBOARD_FORMAT_MAX ||
+			count < G502_MAX_PROFILES || size < G502_OBP_MIN_SECTOR_SIZE ||
+			size > G502_ONBOARD_MAX_SECTOR_SIZE)
+		return -EOPNOTSUPP;
+	gdv->onboard_sector_size = size;
+
+	dir = kmalloc(size, GFP_KERNEL);
+	if (!dir)
+		return -ENOMEM;
+
+	/* Entries are sector (be16), enabled, reserved, then 0xffff */
+	memset(dir, 0xff, size);
+	for (i = 0; i < G502_MAX_PROFILES; i++) {
+		put_unaligned_be16(1 + i, dir + 4 * i);
+		dir[4 * i + 2] = 1;
+		dir[4 * i + 3] = 0;
+	}
+	ret = g502_onboard_write_sector(gdv, G502_ONBOARD_DIR_SECTOR, dir);
+	kfree(dir);
+	if (ret)
+		return ret;
+
+	gdv->onboard_dirty = GENMASK(G502_MAX_PROFILES - 1, 0);
+	ret = g502_onboard_enable(gdv);
+	if (ret)
+		return ret;
+
+	gdv->onboard = true;
+	return 0;
+}
+
+/* Drop to @idle_report_rate once nothing happened for @idle_timeout_ms.
+ * The rate is sent around the confirmed state, so the profile and the
+ * config diffs keep the rate the device is woken up to. Re-arms itself
+ * until the mouse is idle, @wake_work starts it over. */
+static void g502_idle_work(struct work_struct *work)
+{
+	struct logi_g502_data *gdv = container_of(to_delayed_work(work),
+							struct logi_g502_data, idle_work);
+	unsigned int timeout = READ_ONCE(gdv->idle_timeout_ms);
+	struct g502_dev_state state;
+	unsigned long deadline;
+
+	if (!timeout)
+		return;
+
+	deadline = READ_ONCE(gdv->idle_stamp) + msecs_to_jiffies(timeout);
+	if (time_before(jiffies, deadline)) {
+		schedule_delayed_work(&gdv->idle_work, deadline - jiffies);
+		return;
+	}
+
+	mutex_lock(&gdv->mutex_dev);
+	/* The firmware owns the rate in on-board mode */
+	if (!gdv->initialized || gdv->onboard || gdv->idle ||
+			!g502_has_feature(gdv, G502_F_REPORT_RATE))
+		goto out;
+
+	g502_state_read(gdv, &state, NULL);
+	if (!(state.valid & G502_STATE_REPORT_RATE) ||
+			state.report_rate <= gdv->idle_report_rate)
+		goto out;
+
+	if (g502_idle_rate_set(gdv))
+		goto out;
+
+	WRITE_ONCE(gdv->idle, true);
+out:
+	mutex_unlock(&gdv->mutex_dev);
+}
+
+/* Back to the confirmed rate on the first activity. That's the one from
+ * before, unless a profile switch or an edit changed it meanwhile. Those
+ * keep the idle rate, see g502_update_device_config(). */
+static void g502_wake_work(struct work_struct *work)
+{
+	struct logi_g502_data *gdv = container_of(work, struct logi_g502_data,
+							wake_work);
+	u8 params[G502_COMMAND_LONG_SIZE - 4U] = { 0 };
+	struct g502_dev_state state;
+	struct hidpp_report report;
+
+	mutex_lock(&gdv->mutex_dev);
+	if (!gdv->idle)
+		goto out;
+
+	g502_state_read(gdv, &state, NULL);
+	params[0] = report_rate_dth(state.report_rate);
+	__do_fill_report(&report, G502_COMMAND_SHORT_REPORT_ID,
+					gdv->features[G502_F_REPORT_RATE], G502_SET_REPORT_RATE,
+					G502_COMMAND_SHORT_SIZE, params);
+	/* Still idle on errors, the next report tries again */
+	if (gdv->initialized && (state.valid & G502_STATE_REPORT_RATE) &&
+			g502_send_report_sync(gdv, &report, NULL))
+		goto out;
+
+	WRITE_ONCE(gdv->idle, false);
+	if (READ_ONCE(gdv->idle_timeout_ms))
+		schedule_delayed_work(&gdv->idle_work,
+				msecs_to_jiffies(READ_ONCE(gdv->idle_timeout_ms)));
+out:
+	mutex_unlock(&gdv->mutex_dev);
+}
+
+/* Tell userspace a switch went through, see G502_IOC_SELECT_PROFILE.
+ * Called with @mutex_dev held, which keeps the HID++ interface bound. */
+static void g502_switch_done(struct logi_g502_data *gdv, int index, int status)
+{
+	char profile[24], result[24];
+	char *envp[] = { profile, result, NULL };
+
+	atomic_inc(&gdv->switch_done);
+	g502_ring_add(gdv, G502_REC_PROFILE_DONE, 0, 0, status, index, NULL, 0);
+
+	snprintf(profile, sizeof(profile), "G502_PROFILE=%d", index);
+	snprintf(result, sizeof(result), "G502_STATUS=%d", status);
+	kobject_uevent_env(&gdv->cmdq.hdev->dev.kobj, KOBJ_CHANGE, envp);
+}
+
+/* Apply whatever profile G6 or sysfs last asked for. Presses that came in while
+ * we were busy collapse into one, only the final profile is sent. */
+static void g502_switch_profile_work(struct work_struct *work)
+{
+	struct logi_g502_data *gdv = container_of(work, struct logi_g502_data,
+							switch_work);
+	struct g502_profile *target = NULL;
+	struct hid_device *hdev;
+	unsigned long flags;
+	int prev, ret = 0;
+
+	mutex_lock(&gdv->mutex_dev);
+	/* G6 is on interface 0, it may switch while HID++ isn't bound */
+	hdev = READ_ONCE(gdv->cmdq.hdev);
+
+	spin_lock_irqsave(&gdv->switch_lock, flags);
+	prev = gdv->active;
+	if (gdv->pending >= 0) {
+		gdv->active = gdv->pending;
+		target = g502_active_profile(gdv);
+	}
+	gdv->pending = -1;
+	spin_unlock_irqrestore(&gdv->switch_lock, flags);
+
+	/* Before init is done only the choice is recorded, init applies it */
+	if (target) {
+		if (hdev)
+			trace_g502_profile_switch(hdev->id, prev, target->index,
+					target->dev_report_rate, target->dev_dpi);
+		g502_ring_add(gdv, G502_REC_PROFILE, 0, 0, 0, target->index, NULL, 0);
+		g502_publish_profile(gdv, target);
+		if (gdv->onboard)
+			ret = g502_onboard_sync(gdv);
+		else if (gdv->initialized)
+			ret = g502_update_device_config(gdv, target, true);
+		else
+			target = NULL;
+	}
+
+	if (target)
+		g502_switch_done(gdv, target->index, ret);
+	mutex_unlock(&gdv->mutex_dev);
+}
+
+/* Redo the whole config push after a transient failure, backing off
+ * from G502_CONFIG_RETRY_MS. Only the diff against what the device
+ * acked is sent again. A command that ran out of resends fails with
+ * -EAGAIN, the device may well be through whatever kept it busy a
+ * second later. Anything else is permanent. Called with @mutex_dev held. */
+static void g502_config_retry(struct logi_g502_data *gdv, int err)
+{
+	struct hid_device *hdev = gdv->cmdq.hdev;
+
+	if (err != -EAGAIN) {
+		gdv->config_retries = 0;
+		return;
+	}
+
+	if (gdv->config_retries == G502_CONFIG_MAX_RETRIES) {
+		hid_warn(hdev, "%s: giving up on the config push (%d)\n", __func__, err);
+		gdv->config_retries = 0;
+		return;
+	}
+
+	hid_dbg(hdev, "%s: config push failed (%d), retry %u\n", __func__, err,
+			gdv->config_retries + 1);
+	schedule_delayed_work(&gdv->config_work,
+			msecs_to_jiffies(G502_CONFIG_RETRY_MS << gdv->config_retries++));
+}
+
+/* Push the sysfs edits of the active profile, whatever they added up to
+ * since the last run. */
+static void g502_config_work(struct work_struct *work)
+{
+	struct logi_g502_data *gdv = container_of(to_delayed_work(work),
+							struct logi_g502_data, config_work);
+
+	mutex_lock(&gdv->mutex_dev);
+	WRITE_ONCE(gdv->config_stamp, jiffies);
+	if (gdv->onboard)
+		gdv->config_err = g502_onboard_sync(gdv);
+	else
+		gdv->config_err = gdv->initialized ?
+			g502_update_device_config(gdv, g502_active_profile(gdv), true) : 0;
+	g502_config_retry(gdv, gdv->config_err);
+	mutex_unlock(&gdv->mutex_dev);
+}
+
+/* Push the active profile now and wait for the device's ack */
+static int g502_config_flush(struct logi_g502_data *gdv)
+{
+	mod_delayed_work(system_wq, &gdv->config_work, 0);
+	flush_delayed_work(&gdv->config_work);
+	return gdv->config_err;
+}
+
+/* The active profile was edited, with @mutex_dev released after. The
+ * latest value of each field wins, and the device sees at most one
+ * update per G502_CONFIG_FLUSH_MS. With @sync_writes, flush right away
+ * and wait for the ack instead. */
+static int g502_config_changed(struct logi_g502_data *gdv)
+{
+	unsigned long next = READ_ONCE(gdv->config_stamp) +
+				msecs_to_jiffies(G502_CONFIG_FLUSH_MS);
+
+	if (sync_writes)
+		return g502_config_flush(gdv);
+
+	/* A run that's queued already picks this edit up too, but it may
+	 * be a retry backing off for seconds. Bring it in to the usual
+	 * deadline then. */
+	mod_delayed_work(system_wq, &gdv->config_work,
+			time_after(next, jiffies) ? next - jiffies : 0);
+	return 0;
+}
+
+static void g502_led_frame_done(struct g502_cmd *cmd)
+{
+	struct logi_g502_data *gdv = cmd->context;
+
+	/* The LEDs don't show the profile's colour anymore */
+	g502_state_update(gdv, G502_STATE_RGB_ALL, 0, -EAGAIN);
+	atomic_dec(&gdv->led_inflight);
+}
+
+/* Send the zones of @frame that changed since the last one, in one go so
+ * they change together. Runs from @led_timer, so nothing here sleeps. */
+static void g502_led_send_frame(struct logi_g502_data *gdv,
+			const struct g502_led_frame *frame)
+{
+	struct hidpp_report report;
+	struct g502_txn txn;
+	unsigned int nr_cmds;
+	int zone;
+
+	g502_txn_init(&txn, gdv, GFP_ATOMIC);
+	txn.low_prio = true;
+
+	for (zone = 0; zone < gdv->model->nr_led_zones; zone++) {
+		if (gdv->led_last_valid &&
+				gdv->led_last.rgb[zone] == frame->rgb[zone])
+			continue;
+		g502_encode_led(gdv, &report, zone, &g502_led_fixed, frame->rgb[zone]);
+		if (g502_txn_add(&txn, &report, g502_led_frame_done))
+			break;
+	}
+
+	/* Out of memory part way, the zones after @zone didn't go out. What
+	 * was added is still sent, the next frame then sends all of them. */
+	gdv->led_last = *frame;
+	gdv->led_last_valid = zone == gdv->model->nr_led_zones;
+	if (!txn.nr_cmds)
+		return;
+
+	/* Set before, the first ones may be done before the last is sent */
+	nr_cmds = txn.nr_cmds;
+	atomic_set(&gdv->led_inflight, nr_cmds);
+	if (g502_txn_commit_nowait(&txn)) {
+		/* Queue's stopped, resend everything once it's back. Only
+		 * the commands it took will still call g502_led_frame_done(). */
+		atomic_sub(nr_cmds - txn.nr_sent, &gdv->led_inflight);
+		gdv->led_last_valid = false;
+	}
+}
+
+/* One frame per tick, oldest first. While the last frame is still in
+ * flight nothing is sent, and the frames that piled up meanwhile are
+ * merged into the newest one. The timer stops once there's nothing left. */
+static enum hrtimer_restart g502_led_timer(struct hrtimer *timer)
+{
+	struct logi_g502_data *gdv = container_of(timer, struct logi_g502_data,
+							led_timer);
+	struct g502_led_frame frame;
+	unsigned long flags;
+	bool busy;
+
+	spin_lock_irqsave(&gdv->led_lock, flags);
+	busy = atomic_read(&gdv->led_inflight) > 0;
+	if (!gdv->led_count && !busy) {
+		gdv->led_running = false;
+		spin_unlock_irqrestore(&gdv->led_lock, flags);
+		return HRTIMER_NORESTART;
+	}
+
+	if (!busy && gdv->led_count) {
+		frame = gdv->led_ring[gdv->led_head];
+		gdv->led_head = (gdv->led_head + 1) % G502_LED_RING_SIZE;
+		gdv->led_count--;
+		gdv->led_stats.sent++;
+		g502_led_send_frame(gdv, &frame);
+	} else if (busy && gdv->led_count > 1) {
+		gdv->led_stats.merged += gdv->led_count - 1;
+		gdv->led_head = (gdv->led_head + gdv->led_count - 1) % G502_LED_RING_SIZE;
+		gdv->led_count = 1;
+	}
+	spin_unlock_irqrestore(&gdv->led_lock, flags);
+
+	hrtimer_forward_now(timer, ns_to_ktime(NSEC_PER_SEC / G502_LED_MAX_FPS));
+	return HRTIMER_RESTART;
+}
+
+/* Queue a frame, dropping the oldest one if the ring is full */
+static void g502_led_push_frame(struct logi_g502_data *gdv,
+			const struct g502_led_frame *frame)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&gdv->led_lock, flags);
+	if (gdv->led_count == G502_LED_RING_SIZE) {
+		gdv->led_head = (gdv->led_head + 1) % G502_LED_RING_SIZE;
+		gdv->led_count--;
+		gdv->led_stats.dropped++;
+	}
+	gdv->led_ring[(gdv->led_head + gdv->led_count) % G502_LED_RING_SIZE] = *frame;
+	gdv->led_count++;
+	gdv->led_stats.frames++;
+
+	if (!gdv->led_running) {
+		gdv->led_running = true;
+		hrtimer_start(&gdv->led_timer, 0, HRTIMER_MODE_REL);
+	}
+	spin_unlock_irqrestore(&gdv->led_lock, flags);
+}
+
+/* Stop the engine and forget what was queued, e.g. when the HID++
+ * interface goes away. */
+static void g502_led_stop(struct logi_g502_data *gdv)
+{
+	unsigned long flags;
+
+	hrtimer_cancel(&gdv->led_timer);
+
+	spin_lock_irqsave(&gdv->led_lock, flags);
+	gdv->led_running = false;
+	gdv->led_count = 0;
+	gdv->led_last_valid = false;
+	spin_unlock_irqrestore(&gdv->led_lock, flags);
+}
+
+/* Release whatever the player holds down. Called with @macro_lock held. */
+static void __g502_macro_release(struct logi_g502_data *gdv)
+{
+	struct input_dev *input = READ_ONCE(gdv->input_dev);
+	int code;
+
+	if (input) {
+		for_each_set_bit(code, gdv->macro_keys, KEY_CNT)
+			input_report_key(input, code, 0);
+		input_sync(input);
+	}
+	bitmap_zero(gdv->macro_keys, KEY_CNT);
+}
+
+/* Next in line if any. Deleted macros are skipped. Called with
+ * @macro_lock held. */
+static void __g502_macro_next(struct logi_g502_data *gdv)
+{
+	gdv->macro_prog = NULL;
+	while (gdv->macro_qcount && !gdv->macro_prog) {
+		gdv->macro_prog = gdv->macros[gdv->macro_queue[gdv->macro_qhead]];
+		gdv->macro_qhead = (gdv->macro_qhead + 1) % G502_MACRO_QUEUE_LEN;
+		gdv->macro_qcount--;
+	}
+	gdv->macro_pc = 0;
+	if (gdv->macro_prog)
+		gdv->macro_stats.played++;
+}
+
+/* Drop playback and the queue, on remove and suspend. Called with
+ * @macro_lock held. */
+static void __g502_macro_stop(struct logi_g502_data *gdv)
+{
+	gdv->macro_prog = NULL;
+	gdv->macro_qcount = 0;
+	__g502_macro_release(gdv);
+}
+
+/* End the macro playing right away and go on with the queue, for when
+ * it's replaced. Called with @macro_lock held. */
+static void __g502_macro_skip(struct logi_g502_data *gdv)
+{
+	__g502_macro_release(gdv);
+	__g502_macro_next(gdv);
+	if (gdv->macro_prog)
+		hrtimer_start(&gdv->macro_timer, ktime_get(), HRTIMER_MODE_ABS);
+}
+
+static void g502_macro_stop(struct logi_g502_data *gdv)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&gdv->macro_lock, flags);
+	__g502_macro_stop(gdv);
+	spin_unlock_irqrestore(&gdv->macro_lock, flags);
+
+	hrtimer_cancel(&gdv->macro_timer);
+}
+
+/* Runs every op up to the next delay, then rearms itself relative to the
+ * previous expiry, so lateness doesn't add up over a macro. Ops only go
+ * to the input device, the path never waits on anything but @macro_lock. */
+static enum hrtimer_restart g502_macro_timer(struct hrtimer *timer)
+{
+	struct logi_g502_data *gdv = container_of(timer, struct logi_g502_data,
+							macro_timer);
+	struct input_dev *input = READ_ONCE(gdv->input_dev);
+	ktime_t expires = hrtimer_get_expires(timer);
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+	bool reported = false;
+	unsigned long flags;
+	u32 op, delay = 0;
+	s64 late;
+
+	late = ktime_to_ns(ktime_sub(ktime_get(), expires));
+
+	spin_lock_irqsave(&gdv->macro_lock, flags);
+	if (gdv->macro_prog && late > (s64)gdv->macro_stats.late_max_ns)
+		gdv->macro_stats.late_max_ns = late;
+
+	while (gdv->macro_prog && !delay) {
+		if (gdv->macro_pc == gdv->macro_prog->nr_ops) {
+			__g502_macro_next(gdv);
+			continue;
+		}
+
+		op = gdv->macro_prog->ops[gdv->macro_pc++];
+		switch (G502_MOP_ACTION(op)) {
+		case G502_MACRO_KEY_DOWN:
+			__set_bit(G502_MOP_CODE(op), gdv->macro_keys);
+			break;
+		case G502_MACRO_KEY_UP:
+			__clear_bit(G502_MOP_CODE(op), gdv->macro_keys);
+			break;
+		default:
+			goto next;
+		}
+		if (input) {
+			input_report_key(input, G502_MOP_CODE(op),
+					G502_MOP_ACTION(op) == G502_MACRO_KEY_DOWN);
+			reported = true;
+		}
+next:
+		delay = G502_MOP_DELAY(op);
+	}
+
+	if (reported)
+		input_sync(input);
+
+	if (gdv->macro_prog) {
+		hrtimer_set_expires(timer, ktime_add_us(expires, delay));
+		ret = HRTIMER_RESTART;
+	}
+	spin_unlock_irqrestore(&gdv->macro_lock, flags);
+	return ret;
+}
+
+/* Start macro @index, or queue it behind the one playing. Safe from any
+ * context, called from the event path. */
+static void g502_macro_trigger(struct logi_g502_data *gdv, unsigned int index)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&gdv->macro_lock, flags);
+	if (index >= G502_NR_MACROS || !gdv->macros[index])
+		goto out;
+
+	if (!gdv->macro_prog) {
+		gdv->macro_prog = gdv->macros[index];
+		gdv->macro_pc = 0;
+		gdv->macro_stats.played++;
+		hrtimer_start(&gdv->macro_timer, ktime_get(), HRTIMER_MODE_ABS);
+	} else if (gdv->macro_qcount < G502_MACRO_QUEUE_LEN) {
+		gdv->macro_queue[(gdv->macro_qhead + gdv->macro_qcount) %
+				G502_MACRO_QUEUE_LEN] = index;
+		gdv->macro_qcount++;
+		gdv->macro_stats.queued++;
+	} else {
+		gdv->macro_stats.dropped++;
+	}
+out:
+	spin_unlock_irqrestore(&gdv->macro_lock, flags);
+}
+
+/* Account the time the current report took from raw_event to input_sync. */
+static void g502_input_account_sync(struct logi_g502_data *gdv)
+{
+	u64 stamp = this_cpu_read(gdv->istats->stamp);
+	u64 ns;
+
+	if (!stamp)
+		return;
+
+	this_cpu_write(gdv->istats->stamp, 0);
+	ns = ktime_get_ns() - stamp;
+	this_cpu_inc(gdv->istats->sync_buckets[ns ?
+			min_t(u64, ilog2(ns), G502_INPUT_LAT_BUCKETS - 1) : 0]);
+}
+
+/* Make profile @index the active one. Only the target is recorded
+ * here, @switch_work does the actual device I/O. Safe from any context. */
+static int g502_select_profile(struct logi_g502_data *gdv, int index)
+{
+	unsigned long flags;
+
+	if (index < 0 || index >= G502_MAX_PROFILES)
+		return -EINVAL;
+
+	spin_lock_irqsave(&gdv->switch_lock, flags);
+	gdv->pending = index;
+	spin_unlock_irqrestore(&gdv->switch_lock, flags);
+
+	schedule_work(&gdv->switch_work);
+	return 0;
+}
+
+/* Switch profiles on BTN_9 Click interrupt. Wraps around to the first
+ * profile after the last one. Step from a switch that is still pending,
+ * so quick presses add up. */
+static int g502_switch_profile(struct logi_g502_data *gdv)
+{
+	unsigned long flags;
+	int next;
+
+	spin_lock_irqsave(&gdv->switch_lock, flags);
+	next = (gdv->pending >= 0 ? gdv->pending : gdv->active) + 1;
+	spin_unlock_irqrestore(&gdv->switch_lock, flags);
+
+	return g502_select_profile(gdv, next % G502_MAX_PROFILES);
+}
+
+/* Reports are X, Y (le16) and the wheels after the buttons */
+static void g502_idle_activity(struct logi_g502_data *gdv, const u8 *data,
+			u16 changed)
+{
+	int motion = abs((s16)get_unaligned_le16(&data[2])) +
+			abs((s16)get_unaligned_le16(&data[4]));
+
+	if (!changed && !data[6] && !data[7] && motion < G502_IDLE_WAKE_COUNTS)
+		return;
+
+	WRITE_ONCE(gdv->idle_stamp, jiffies);
+	if (READ_ONCE(gdv->idle))
+		schedule_work(&gdv->wake_work);
+}
+
+/* Send one of the commands the DPI buttons use, without waiting for it */
+static void g502_dpi_send(struct logi_g502_data *gdv,
+			const struct hidpp_report *report, g502_cmd_done_t done, bool low_prio)
+{
+	struct g502_txn txn;
+
+	g502_txn_init(&txn, gdv, GFP_ATOMIC);
+	txn.low_prio = low_prio;
+	if (!g502_txn_add(&txn, report, done))
+		g502_txn_commit_nowait(&txn);
+}
+
+/* DPI up, down and shift. A press or release sends the one pre-encoded
+ * SET it needs, the stage LED follows at low priority so it never holds
+ * the DPI back. The new stage is stored in the profile by @dpi_work.
+ * On-board profiles have the mouse do all of this itself. */
+static void g502_dpi_button(struct logi_g502_data *gdv, u8 type, bool pressed)
+{
+	struct g502_dpi_state *dpi = &gdv->dpi;
+	struct hidpp_report cmd, led;
+	unsigned long flags;
+	int stage;
+
+	if (READ_ONCE(gdv->onboard) || !g502_has_feature(gdv, G502_F_DPI))
+		return;
+
+	cmd.report_id = 0;
+	led.report_id = 0;
+
+	spin_lock_irqsave(&gdv->dpi_lock, flags);
+	if (type == G502_BUTTON_DPI_SHIFT) {
+		if (dpi->shifted != pressed &&
+				g502_dpi_cmd(dpi, G502_PCMD_DPI_SHIFT)->report_id) {
+			dpi->shifted = pressed;
+			cmd = *g502_dpi_cmd(dpi, pressed ? G502_PCMD_DPI_SHIFT :
+					G502_PCMD_DPI_STAGE + dpi->stage);
+		}
+	} else if (pressed) {
+		stage = dpi->stage + (type == G502_BUTTON_DPI_UP ? 1 : -1);
+		if (stage >= 0 && stage < dpi->nr_stages) {
+			dpi->stage = stage;
+			/* Shifting wins, the release sends the new stage */
+			if (!dpi->shifted)
+				cmd = *g502_dpi_cmd(dpi, G502_PCMD_DPI_STAGE + stage);
+			led = *g502_dpi_cmd(dpi, G502_PCMD_DPI_LED + stage);
+		}
+	}
+	spin_unlock_irqrestore(&gdv->dpi_lock, flags);
+
+	if (cmd.report_id)
+		g502_dpi_send(gdv, &cmd, g502_dpi_set_done, false);
+	/* Software effects own the LEDs while they run */
+	if (led.report_id && !READ_ONCE(gdv->led_running))
+		g502_dpi_send(gdv, &led, g502_rgb_set_done, true);
+	if (led.report_id || cmd.report_id)
+		schedule_work(&gdv->dpi_work);
+}
+
+/* Store the stage the DPI buttons left the profile at, so that the next
+ * diff and G502_IOC_GET_PROFILES agree with the device. The event path's
+ * copy is left alone, it's the newer one. */
+static void g502_dpi_work(struct work_struct *work)
+{
+	struct logi_g502_data *gdv = container_of(work, struct logi_g502_data,
+							dpi_work);
+	struct g502_profile *prof;
+	unsigned long flags;
+	int index, stage;
+
+	mutex_lock(&gdv->mutex_dev);
+
+	spin_lock_irqsave(&gdv->dpi_lock, flags);
+	index = gdv->dpi.index;
+	stage = gdv->dpi.stage;
+	spin_unlock_irqrestore(&gdv->dpi_lock, flags);
+
+	prof = &gdv->profiles[index];
+	if (stage < prof->nr_dpi_stages && stage != prof->dpi_stage) {
+		prof->dpi_stage = stage;
+		prof->dev_dpi = prof->dpi_stages[stage];
+		g502_encode_profile(gdv, prof);
+
+		write_seqlock_irqsave(&gdv->state_lock, flags);
+		if (gdv->snap.index == index)
+			gdv->snap.dpi = prof->dev_dpi;
+		write_sequnlock_irqrestore(&gdv->state_lock, flags);
+	}
+
+	mutex_unlock(&gdv->mutex_dev);
+}
+
+/* A remapped button went down or up. Only keys care about the release. */
+static void g502_button_event(struct logi_g502_data *gdv, struct input_dev *input,
+			const struct g502_button *act, int bit, bool pressed)
+{
+	switch (act->type) {
+	case G502_BUTTON_KEY:
+		if (!pressed)
+			break;
+		gdv->btn_keys |= BIT(bit);
+		gdv->btn_held[bit] = act->code;
+		input_report_key(input, act->code, 1);
+		break;
+	case G502_BUTTON_PROFILE_NEXT:
+		if (pressed) {
+			this_cpu_inc(gdv->istats->switches);
+			g502_switch_profile(gdv);
+		}
+		break;
+	case G502_BUTTON_HWHEEL:
+		if (pressed) {
+			input_report_rel(input, REL_HWHEEL, (s16)act->code);
+			input_report_rel(input, REL_HWHEEL_HI_RES, (s16)act->code * 120);
+		}
+		break;
+	case G502_BUTTON_MACRO:
+		if (pressed)
+			g502_macro_trigger(gdv, act->code);
+		break;
+	case G502_BUTTON_DPI_UP:
+	case G502_BUTTON_DPI_DOWN:
+	case G502_BUTTON_DPI_SHIFT:
+		g502_dpi_button(gdv, act->type, pressed);
+		break;
+	}
+}
+
+/* Handle the regular mouse events. The buttons are the first 16 bits,
+ * whatever changed since the last report and is remapped in the active
+ * profile is acted on here, then cleared so hid-core only sees the rest.
+ * Our events go out with hid-core's input_sync. */
+static int g502_handle_regular_event(struct logi_g502_data *gdv,
+			struct input_dev *input, u8 *data)
+{
+	const struct g502_button_map *map;
+	unsigned long bits;
+	u16 buttons, changed;
+	int bit;
+
+	if (input == NULL)
+		return 1;
+
+	buttons = get_unaligned_le16(data);
+	changed = buttons ^ gdv->btn_last;
+	gdv->btn_last = buttons;
+
+	if (READ_ONCE(gdv->idle_timeout_ms))
+		g502_idle_activity(gdv, data, changed);
+
+	/* Keys we pressed are released as such, even if the map changed since */
+	bits = changed & gdv->btn_keys;
+	for_each_set_bit(bit, &bits, G502_NR_BUTTONS)
+		input_report_key(input, gdv->btn_held[bit], 0);
+	gdv->btn_keys &= ~bits;
+
+	rcu_read_lock();
+	map = rcu_dereference(gdv->btn_map);
+	if (!map || !((buttons | changed) & map->remapped)) {
+		rcu_read_unlock();
+		/* Nothing for us, hid-core reports and syncs it */
+		this_cpu_inc(gdv->istats->passed);
+		return 1;
+	}
+
+	bits = changed & map->remapped & ~bits;
+	for_each_set_bit(bit, &bits, G502_NR_BUTTONS)
+		g502_button_event(gdv, input, &map->act[bit], bit, buttons & BIT(bit));
+	buttons &= ~map->remapped;
+	rcu_read_unlock();
+
+	put_unaligned_le16(buttons & ~gdv->btn_keys, data);
+	return 1;
+}
+
+/* The mouse declares 16 buttons, but only has 9 hid-core should see,
+ * the tilt wheel bits are ours (see g502_handle_regular_event()).
+ * Dropping the Report Count alone shifts X/Y by 7 bits and shortens the
+ * report the device keeps sending 8 bytes of, hence -EOVERFLOW. Here the
+ * unused bits become constant padding, the layout stays the same:
+ * 9 buttons, 7 bits padding, X and Y (16 bits), wheel and AC pan (8 bits). */
+static const u8 g502_hero_rdesc_fixed[] = {
+	0x05, 0x01,			/* Usage Page (Generic Desktop) */
+	0x09, 0x02,			/* Usage (Mouse) */
+	0xa1, 0x01,			/* Collection (Application) */
+	0x09, 0x01,			/*   Usage (Pointer) */
+	0xa1, 0x00,			/*   Collection (Physical) */
+	0x05, 0x09,			/*     Usage Page (Button) */
+	0x19, 0x01,			/*     Usage Minimum (1) */
+	0x29, 0x09,			/*     Usage Maximum (9) */
+	0x15, 0x00,			/*     Logical Minimum (0) */
+	0x25, 0x01,			/*     Logical Maximum (1) */
+	0x95, 0x09,			/*     Report Count (9) */
+	0x75, 0x01,			/*     Report Size (1) */
+	0x81, 0x02,			/*     Input (Data,Var,Abs) */
+	0x95, 0x07,			/*     Report Count (7) */
+	0x75, 0x01,			/*     Report Size (1) */
+	0x81, 0x03,			/*     Input (Cnst,Var,Abs) */
+	0x05, 0x01,			/*     Usage Page (Generic Desktop) */
+	0x16, 0x01, 0x80,	/*     Logical Minimum (-32767) */
+	0x26, 0xff, 0x7f,	/*     Logical Maximum (32767) */
+	0x75, 0x10,			/*     Report Size (16) */
+	0x95, 0x02,			/*     Report Count (2) */
+	0x09, 0x30,			/*     Usage (X) */
+	0x09, 0x31,			/*     Usage (Y) */
+	0x81, 0x06,			/*     Input (Data,Var,Rel) */
+	0x15, 0x81,			/*     Logical Minimum (-127) */
+	0x25, 0x7f,			/*     Logical Maximum (127) */
+	0x75, 0x08,			/*     Report Size (8) */
+	0x95, 0x01,			/*     Report Count (1) */
+	0x09, 0x38,			/*     Usage (Wheel) */
+	0x81, 0x06,			/*     Input (Data,Var,Rel) */
+	0x05, 0x0c,			/*     Usage Page (Consumer) */
+	0x0a, 0x38, 0x02,	/*     Usage (AC Pan) */
+	0x95, 0x01,			/*     Report Count (1) */
+	0x81, 0x06,			/*     Input (Data,Var,Rel) */
+	0xc0,				/*   End Collection */
+	0xc0,				/* End Collection */
+};
+
+/* Known original descriptors. Another firmware revision with a different
+ * one gets its own entry, anything unknown is left alone. */
+static const struct g502_rdesc_fixup g502_rdesc_fixups[] = {
+	{ 67, 0x25eacfcb, g502_hero_rdesc_fixed, sizeof(g502_hero_rdesc_fixed) },
+};
+
+static __u8 *g502_report_fixup(struct hid_device *hdev,
+				__u8 *rdesc, unsigned int *rsize)
+{
+	const struct g502_rdesc_fixup *fix;
+	u32 crc;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(g502_rdesc_fixups); i++) {
+		fix = &g502_rdesc_fixups[i];
+		if (*rsize != fix->size)
+			continue;
+
+		crc = crc32_le(~0U, rdesc, *rsize) ^ ~0U;
+		if (crc != fix->crc)
+			continue;
+
+		hid_info(hdev, "replacing report descriptor (%u bytes, crc32 %08x)\n",
+				*rsize, crc);
+		*rsize = fix->rsize;
+		/* hid-core copies it, it's never written */
+		return (__u8 *)fix->rdesc;
+	}
+
+	/* rdesc[15] = Usage Maximum, rdesc[21] = Report Count. Looks like ours
+	 * but isn't in the table: hide the extra usages (the bits stay) and
+	 * log what an entry for it needs. */
+	if (*rsize == 67 && rdesc[15] == 16 && rdesc[21] == 16) {
+		hid_info(hdev, "unknown report descriptor (%u bytes, crc32 %08x), only fixing up usages\n",
+				*rsize, crc32_le(~0U, rdesc, *rsize) ^ ~0U);
+		rdesc[15] = 0x09;
+	}
+
+	return rdesc;
+}
+
+#define g502_map_key_clear(c)  hid_map_usage_clear(hi, usage, bit, max, EV_KEY, (c))
+
+/* Button usages we don't leave to hid-core, 0 for the default mapping.
+ * G6 is BTN_9 when its profile cycling is remapped to DEFAULT. */
+static const u16 g502_usage_keys[G502_NR_BUTTONS + 1] = {
+	[G502_BUTTON_BIT_G6 + 1]	= BTN_9,
+};
+
+static int g502_input_mapping(struct hid_device *hdev, struct hid_input *hi,
+		struct hid_field *field, struct hid_usage *usage,
+		unsigned long **bit, int *max)
+{
+	unsigned int button = usage->hid & HID_USAGE;
+
+	if ((usage->hid & HID_USAGE_PAGE) != HID_UP_BUTTON)
+		return 0;
+	if (g502_is_hidpp_intf(hdev))
+		return 0;
+	if (button > G502_NR_BUTTONS || !g502_usage_keys[button])
+		return 0;
+
+	g502_map_key_clear(g502_usage_keys[button]);
+	return 1;
+}
+
+/* Runs before the input device registers, the last chance to tell
+ * evdev about anything a remapped button may send. */
+static int g502_input_configured(struct hid_device *hdev, struct hid_input *hi)
+{
+	unsigned int code;
+
+	if (g502_is_hidpp_intf(hdev))
+		return 0;
+
+	for (code = KEY_ESC; code <= KEY_MICMUTE; code++)
+		input_set_capability(hi->input, EV_KEY, code);
+	for (code = BTN_LEFT; code <= BTN_TASK; code++)
+		input_set_capability(hi->input, EV_KEY, code);
+	input_set_capability(hi->input, EV_REL, REL_HWHEEL);
+	input_set_capability(hi->input, EV_REL, REL_HWHEEL_HI_RES);
+	return 0;
+}
+
+/*
+ * Parse the hidpp_report contents we received.
+ *
+ * SET_REPORT response is empty, probably just a handshake,
+ * because that's how the protocol works. Now, the actual data
+ * comes as USB_INTERRUPT, meaning that HID I/O are independent
+ * from each other. We validate it and store the contents.
+ */
+static int g502_raw_event(struct hid_device *hdev,
+		struct hid_report *report, u8 *data, int size)
+{
+	struct hidpp_report *response = (struct hidpp_report *)data;
+	struct g502_intf *gi = hid_get_drvdata(hdev);
+	struct logi_g502_data *gdv = gi->gdv;
+	struct input_dev *input = gi->input_dev;
+	struct g502_cmd *cmd;
+	int status;
+
+	trace_g502_raw_event(hdev->id, report ? report->id : 0, size);
+
+	/* Regular events. We have no access to the URB's completion time,
+	 * but raw_event runs right from it, so that's our starting point. */
+	if (size == 8 && gi->mouse) {
+		this_cpu_write(gdv->istats->stamp, ktime_get_ns());
+		this_cpu_inc(gdv->istats->processed);
+		return g502_handle_regular_event(gdv, input, data);
+	}
+
+	/* Replies normally come back LONG, but errors may mirror a SHORT request. */
+	if (!(response->report_id == G502_COMMAND_LONG_REPORT_ID &&
+			size == G502_COMMAND_LONG_SIZE) &&
+		!(response->report_id == G502_COMMAND_SHORT_REPORT_ID &&
+			size == G502_COMMAND_SHORT_SIZE))
+		return 1;
+
+	g502_ring_add(gdv, G502_REC_REPORT, response->feature_index,
+			response->funcindex_clientid & G502_FUNCTION_MASK, 0, 0, data, size);
+
+	/* Only replies to something we have in flight are trusted,
+	 * the command's callback takes it from there. */
+	cmd = g502_cmdq_match(&gdv->cmdq, response, size, &status);
+	if (!cmd) {
+		trace_g502_reply_dropped(hdev->id, response->feature_index,
+				response->funcindex_clientid);
+		return 1;
+	}
+
+	g502_cmd_finish(&gdv->cmdq, cmd, status);
+	return 0;
+}
+
+/* Called by hid-core after it processed a report, right before its own
+ * input_sync. Closes the latency sample of reports we passed through. */
+static void g502_report(struct hid_device *hdev, struct hid_report *report)
+{
+	struct logi_g502_data *gdv = g502_hdev_to_gdv(hdev);
+
+	g502_input_account_sync(gdv);
+}
+
+/* We define a macro to handle the attributes' show operations.
+ * as it's simply the same for all. They show what the device runs at,
+ * see g502_state_get(). */
+#define G502_ATTR_SHOW(name, feature_uppercase)			       				\
+	static ssize_t name##_show(struct device *dev,			       			\
+			struct device_attribute *attr, char *buf)						\
+	{								       									\
+		struct logi_g502_data *gdv = g502_hdev_to_gdv(to_hid_device(dev));	\
+		unsigned int value;													\
+		int ret;															\
+																			\
+		ret = g502_state_get(gdv, G502_STATE_##feature_uppercase, &value);	\
+		if (ret)															\
+			return ret;														\
+		return sysfs_emit(buf, "%u\n", value);								\
+	}
+
+/* Re-encode and publish the active profile after an edit, under @mutex_dev.
+ * A fresh edit starts the config retry backoff over. */
+static void g502_edit_profile(struct logi_g502_data *gdv)
+{
+	g502_encode_profile(gdv, g502_active_profile(gdv));
+	g502_publish_profile(gdv, g502_active_profile(gdv));
+	gdv->config_retries = 0;
+}
+
+static ssize_t report_rate_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct logi_g502_data *gdv = g502_hdev_to_gdv(to_hid_device(dev));
+	unsigned __report_rate;
+	int ret;
+
+	if (kstrtouint(buf, 0, &__report_rate))
+		return -EINVAL;
+	if (!(report_rate_dth(__report_rate) & gdv->model->rate_mask))
+		return -EINVAL;
+
+	mutex_lock(&gdv->mutex_dev);
+	g502_active_profile(gdv)->dev_report_rate = __report_rate;
+	g502_edit_profile(gdv);
+	mutex_unlock(&gdv->mutex_dev);
+
+	ret = g502_config_changed(gdv);
+	return ret ? ret : count;
+}
+
+static ssize_t dpi_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct logi_g502_data *gdv = g502_hdev_to_gdv(to_hid_device(dev));
+	struct g502_profile *prof;
+	u16 dpi_requested;
+	int ret;
+
+	if (kstrtou16(buf, 0, &dpi_requested))
+		return -EINVAL;
+	if (!dpi_requested || dpi_requested > gdv->model->max_dpi)
+		return -EINVAL;
+
+	mutex_lock(&gdv->mutex_dev);
+	prof = g502_active_profile(gdv);
+	prof->dev_dpi = dpi_requested;
+	prof->dpi_stages[prof->dpi_stage] = dpi_requested;
+	g502_edit_profile(gdv);
+	mutex_unlock(&gdv->mutex_dev);
+
+	ret = g502_config_changed(gdv);
+	return ret ? ret : count;
+}
+
+static ssize_t rgb_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct logi_g502_data *gdv = g502_hdev_to_gdv(to_hid_device(dev));
+	struct g502_snapshot snap;
+
+	g502_state_read(gdv, NULL, &snap);
+	return sysfs_emit(buf, "%06x %06x\n", snap.rgb[G_LED_PRIMARY],
+			snap.rgb[G_LED_LOGO]);
+}
+
+/* Takes one RRGGBB in hex for all LED zones or one per zone, primary
+ * first, set as a fixed colour. 0 stops overriding whatever that zone
+ * is doing. */
+static ssize_t rgb_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct logi_g502_data *gdv = g502_hdev_to_gdv(to_hid_device(dev));
+	unsigned int rgb[G502_MAX_LED_ZONES];
+	int n, ret;
+
+	n = sscanf(buf, "%x %x", &rgb[G_LED_PRIMARY], &rgb[G_LED_LOGO]);
+	if (n < 1)
+		return -EINVAL;
+	if (n == 1)
+		rgb[G_LED_LOGO] = rgb[G_LED_PRIMARY];
+	if (rgb[G_LED_PRIMARY] > 0xffffff || rgb[G_LED_LOGO] > 0xffffff)
+		return -EINVAL;
+
+	mutex_lock(&gdv->mutex_dev);
+	memcpy(g502_active_profile(gdv)->dev_rgb, rgb, sizeof(rgb));
+	g502_edit_profile(gdv);
+	mutex_unlock(&gdv->mutex_dev);
+
+	ret = g502_config_changed(gdv);
+	return ret ? ret : count;
+}
+
+static ssize_t profile_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct logi_g502_data *gdv = g502_hdev_to_gdv(to_hid_device(dev));
+	struct g502_snapshot snap;
+
+	g502_state_read(gdv, NULL, &snap);
+	return sysfs_emit(buf, "%d\n", snap.index);
+}
+
+/* Jump straight to a profile. Returns once it's applied (or recorded,
+ * if init isn't done yet), same as the other attributes. */
+static ssize_t profile_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct logi_g502_data *gdv = g502_hdev_to_gdv(to_hid_device(dev));
+	int index;
+	int ret;
+
+	if (kstrtoint(buf, 0, &index))
+		return -EINVAL;
+
+	ret = g502_select_profile(gdv, index);
+	if (ret)
+		return ret;
+
+	flush_work(&gdv->switch_work);
+	return count;
+}
+
+/* Takes one RRGGBB for all zones or one per zone, primary first.
+ * Meant to be written a lot, see g502_led_timer(). */
+static ssize_t led_frame_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct logi_g502_data *gdv = g502_hdev_to_gdv(to_hid_device(dev));
+	struct g502_led_frame frame;
+	int n;
+
+	if (!g502_has_feature(gdv, G502_F_COLOR_LED))
+		return -EOPNOTSUPP;
+
+	n = sscanf(buf, "%x %x", &frame.rgb[G_LED_PRIMARY], &frame.rgb[G_LED_LOGO]);
+	if (n < 1)
+		return -EINVAL;
+	if (n == 1)
+		frame.rgb[G_LED_LOGO] = frame.rgb[G_LED_PRIMARY];
+	if (frame.rgb[G_LED_PRIMARY] > 0xffffff || frame.rgb[G_LED_LOGO] > 0xffffff)
+		return -EINVAL;
+
+	g502_led_push_frame(gdv, &frame);
+	return count;
+}
+
+static ssize_t idle_timeout_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct logi_g502_data *gdv = g502_hdev_to_gdv(to_hid_device(dev));
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(gdv->idle_timeout_ms));
+}
+
+/* In ms, 0 turns the adaptive report rate off and restores the rate */
+static ssize_t idle_timeout_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct logi_g502_data *gdv = g502_hdev_to_gdv(to_hid_device(dev));
+	unsigned int timeout;
+
+	if (kstrtouint(buf, 0, &timeout))
+		return -EINVAL;
+	if (timeout && timeout < G502_IDLE_MIN_TIMEOUT_MS)
+		return -EINVAL;
+
+	WRITE_ONCE(gdv->idle_stamp, jiffies);
+	WRITE_ONCE(gdv->idle_timeout_ms, timeout);
+	if (timeout) {
+		mod_delayed_work(system_wq, &gdv->idle_work, msecs_to_jiffies(timeout));
+	} else {
+		cancel_delayed_work_sync(&gdv->idle_work);
+		schedule_work(&gdv->wake_work);
+		flush_work(&gdv->wake_work);
+	}
+	return count;
+}
+
+static ssize_t idle_report_rate_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct logi_g502_data *gdv = g502_hdev_to_gdv(to_hid_device(dev));
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(gdv->idle_report_rate));
+}
+
+/* Takes effect the next time the mouse goes idle */
+static ssize_t idle_report_rate_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct logi_g502_data *gdv = g502_hdev_to_gdv(to_hid_device(dev));
+	unsigned int rate;
+
+	if (kstrtouint(buf, 0, &rate))
+		return -EINVAL;
+	if (!(report_rate_dth(rate) & gdv->model->rate_mask))
+		return -EINVAL;
+
+	mutex_lock(&gdv->mutex_dev);
+	gdv->idle_report_rate = rate;
+	mutex_unlock(&gdv->mutex_dev);
+	return count;
+}
+
+/* One line per firmware entity: type, name, version.revision and build */
+static ssize_t firmware_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct logi_g502_data *gdv = g502_hdev_to_gdv(to_hid_device(dev));
+	const struct gfirmware *fw;
+	const char *type;
+	int i, len = 0;
+
+	/* Empty until discovery is through */
+	if (!smp_load_acquire(&gdv->fw_ready))
+		return 0;
+
+	for (i = 0; i < G502_FW_MAX_ENTITIES; i++) {
+		fw = &gdv->gfw[i];
+		if (!fw->valid)
+			continue;
+
+		type = fw->ftype < ARRAY_SIZE(g502_fw_type_names) ?
+				g502_fw_type_names[fw->ftype] : NULL;
+		len += sysfs_emit_at(buf, len, "%s %s %02x.%02x.%04x\n",
+				type ?: "other", fw->name, fw->version, fw->revision,
+				fw->build);
+	}
+	return len;
+}
+
+G502_ATTR_SHOW(report_rate, REPORT_RATE);
+G502_ATTR_SHOW(dpi, DPI);
+
+static DEVICE_ATTR_RW(report_rate);
+static DEVICE_ATTR_RW(dpi);
+static DEVICE_ATTR_RW(profile);
+static DEVICE_ATTR_RW(rgb);
+static DEVICE_ATTR_WO(led_frame);
+static DEVICE_ATTR_RO(firmware);
+static DEVICE_ATTR_RW(idle_timeout);
+static DEVICE_ATTR_RW(idle_report_rate);
+
+static const struct attribute_group g502_group = {
+	.attrs = (struct attribute *[]) {
+		&dev_attr_report_rate.attr,
+		&dev_attr_dpi.attr,
+		&dev_attr_profile.attr,
+		&dev_attr_rgb.attr,
+		&dev_attr_led_frame.attr,
+		&dev_attr_firmware.attr,
+		&dev_attr_idle_timeout.attr,
+		&dev_attr_idle_report_rate.attr,
+		NULL,
+	}
+};
+
+static int g502_latency_show(struct seq_file *m, void *unused)
+{
+	struct logi_g502_data *gdv = m->private;
+	struct g502_cmdq *q = &gdv->cmdq;
+	struct g502_lat_stats stats;
+	unsigned long flags;
+	int i, b;
+
+	for (i = 0; i <= G502_F_NR; i++) {
+		spin_lock_irqsave(&q->lock, flags);
+		stats = q->stats[i];
+		spin_unlock_irqrestore(&q->lock, flags);
+
+		seq_printf(m, "%s: replies %llu timeouts %llu errors %llu avg %lluus max %lluus\n",
+				g502_feature_names[i], stats.replies, stats.timeouts, stats.errors,
+				stats.replies ? div64_u64(stats.total_us, stats.replies) : 0,
+				stats.max_us);
+
+		for (b = 0; b < G502_LAT_BUCKETS; b++) {
+			if (!stats.buckets[b])
+				continue;
+			if (b == G502_LAT_BUCKETS - 1)
+				seq_printf(m, "\t[%8luus,       inf): %llu\n",
+						BIT(b), stats.buckets[b]);
+			else
+				seq_printf(m, "\t[%8luus, %8luus): %llu\n",
+						b ? BIT(b) : 0, BIT(b + 1), stats.buckets[b]);
+		}
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(g502_latency);
+
+static int g502_errors_show(struct seq_file *m, void *unused)
+{
+	struct logi_g502_data *gdv = m->private;
+	struct g502_cmdq *q = &gdv->cmdq;
+	struct g502_cmdq_health health;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&q->lock, flags);
+	health = q->health;
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	for (i = 0; i < G502_HIDPP_ERR_NR; i++)
+		seq_printf(m, "%s: %llu\n", g502_hidpp_errors[i].name, health.hidpp[i]);
+	seq_printf(m, "timeouts %llu send_errors %llu retried %llu recovered %llu exhausted %llu\n",
+			health.timeouts, health.send_errors, health.retried,
+			health.recovered, health.exhausted);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(g502_errors);
+
+static int g502_input_show(struct seq_file *m, void *unused)
+{
+	struct logi_g502_data *gdv = m->private;
+	u64 buckets[G502_INPUT_LAT_BUCKETS] = { 0 };
+	u64 processed = 0, passed = 0, switches = 0;
+	struct g502_input_stats *istats;
+	int cpu, b;
+
+	for_each_possible_cpu(cpu) {
+		istats = per_cpu_ptr(gdv->istats, cpu);
+		processed += READ_ONCE(istats->processed);
+		passed += READ_ONCE(istats->passed);
+		switches += READ_ONCE(istats->switches);
+		for (b = 0; b < G502_INPUT_LAT_BUCKETS; b++)
+			buckets[b] += READ_ONCE(istats->sync_buckets[b]);
+	}
+
+	seq_printf(m, "processed %llu passed %llu profile_switches %llu\n",
+			processed, passed, switches);
+	seq_puts(m, "raw_event to input_sync:\n");
+	for (b = 0; b < G502_INPUT_LAT_BUCKETS; b++) {
+		if (!buckets[b])
+			continue;
+		if (b == G502_INPUT_LAT_BUCKETS - 1)
+			seq_printf(m, "\t[%8luns,       inf): %llu\n", BIT(b), buckets[b]);
+		else
+			seq_printf(m, "\t[%8luns, %8luns): %llu\n",
+					b ? BIT(b) : 0, BIT(b + 1), buckets[b]);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(g502_input);
+
+static int g502_led_show(struct seq_file *m, void *unused)
+{
+	struct logi_g502_data *gdv = m->private;
+	struct g502_led_stats stats;
+	unsigned long flags;
+
+	spin_lock_irqsave(&gdv->led_lock, flags);
+	stats = gdv->led_stats;
+	spin_unlock_irqrestore(&gdv->led_lock, flags);
+
+	seq_printf(m, "frames %llu sent %llu merged %llu dropped %llu\n",
+			stats.frames, stats.sent, stats.merged, stats.dropped);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(g502_led);
+
+static int g502_macro_show(struct seq_file *m, void *unused)
+{
+	struct logi_g502_data *gdv = m->private;
+	struct g502_macro_stats stats;
+	unsigned long flags;
+
+	spin_lock_irqsave(&gdv->macro_lock, flags);
+	stats = gdv->macro_stats;
+	spin_unlock_irqrestore(&gdv->macro_lock, flags);
+
+	seq_printf(m, "played %llu queued %llu dropped %llu late_max_ns %llu\n",
+			stats.played, stats.queued, stats.dropped, stats.late_max_ns);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(g502_macro);
+
+static void g502_debugfs_init(struct logi_g502_data *gdv, struct hid_device *hdev)
+{
+	gdv->debugfs = debugfs_create_dir(dev_name(&hdev->dev), g502_debugfs_root);
+	debugfs_create_file("latency", 0444, gdv->debugfs, gdv, &g502_latency_fops);
+	debugfs_create_file("errors", 0444, gdv->debugfs, gdv, &g502_errors_fops);
+	debugfs_create_file("input", 0444, gdv->debugfs, gdv, &g502_input_fops);
+	debugfs_create_file("led", 0444, gdv->debugfs, gdv, &g502_led_fops);
+	debugfs_create_file("macro", 0444, gdv->debugfs, gdv, &g502_macro_fops);
+}
+
+static void g502_device_put(struct logi_g502_data *gdv);
+
+static int g502_dev_open(struct inode *inode, struct file *file)
+{
+	struct logi_g502_data *gdv = container_of(file->private_data,
+							struct logi_g502_data, misc);
+	struct g502_file *gf;
+
+	gf = kzalloc(sizeof(*gf), GFP_KERNEL);
+	if (!gf)
+		return -ENOMEM;
+
+	/* Registered means someone holds a reference, it can't go away under us */
+	kref_get(&gdv->ref);
+	gf->gdv = gdv;
+	gf->poll_head = smp_load_acquire(&gdv->ring->head);
+	gf->poll_switch = atomic_read(&gdv->switch_done);
+	file->private_data = gf;
+	return nonseekable_open(inode, file);
+}
+
+static int g502_dev_release(struct inode *inode, struct file *file)
+{
+	struct g502_file *gf = file->private_data;
+
+	g502_device_put(gf->gdv);
+	kfree(gf);
+	return 0;
+}
+
+/* The ring is read-only for userspace, we are its only writer */
+static int g502_dev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct g502_file *gf = file->private_data;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+	return remap_vmalloc_range(vma, gf->gdv->ring, vma->vm_pgoff);
+}
+
+static __poll_t g502_dev_poll(struct file *file, poll_table *wait)
+{
+	struct g502_file *gf = file->private_data;
+	struct logi_g502_data *gdv = gf->gdv;
+	__poll_t mask = 0;
+	u32 head, switched;
+
+	poll_wait(file, &gdv->ring_wait, wait);
+
+	head = smp_load_acquire(&gdv->ring->head);
+	if (head != gf->poll_head) {
+		gf->poll_head = head;
+		mask |= EPOLLIN | EPOLLRDNORM;
+	}
+	switched = atomic_read(&gdv->switch_done);
+	if (switched != gf->poll_switch) {
+		gf->poll_switch = switched;
+		mask |= EPOLLPRI;
+	}
+	if (!READ_ONCE(gdv->misc_registered))
+		mask |= EPOLLHUP;
+
+	return mask;
+}
+
+/* Everything in @desc is checked before any profile is touched */
+static int g502_profile_desc_check(struct logi_g502_data *gdv,
+			const struct g502_profile_desc *desc)
+{
+	int i;
+
+	if (desc->report_rate &&
+			!(report_rate_dth(desc->report_rate) & gdv->model->rate_mask))
+		return -EINVAL;
+
+	if (!desc->nr_dpi_stages || desc->nr_dpi_stages > G502_MAX_DPI_STAGES ||
+			desc->dpi_stage >= desc->nr_dpi_stages)
+		return -EINVAL;
+	for (i = 0; i < desc->nr_dpi_stages; i++)
+		if (!desc->dpi[i] || desc->dpi[i] > gdv->model->max_dpi)
+			return -EINVAL;
+	if (desc->shift_dpi > gdv->model->max_dpi)
+		return -EINVAL;
+
+	for (i = 0; i < G502_NR_LED_ZONES; i++) {
+		const struct g502_led *led = &desc->leds[i];
+
+		if (led->effect >= G502_LED_EFFECT_NR)
+			return -EOPNOTSUPP;
+		if (led->rgb > 0xffffff || led->brightness > 100)
+			return -EINVAL;
+		if (led->period_ms && (led->period_ms < G502_LED_PERIOD_MIN_MS ||
+				led->period_ms > G502_LED_PERIOD_MAX_MS))
+			return -EINVAL;
+	}
+
+	for (i = 0; i < G502_NR_BUTTONS; i++) {
+		const struct g502_button *b = &desc->buttons[i];
+
+		if (b->type >= G502_BUTTON_TYPE_NR)
+			return -EOPNOTSUPP;
+		if (b->type == G502_BUTTON_KEY && !g502_key_remappable(b->code))
+			return -EINVAL;
+		if (b->type == G502_BUTTON_HWHEEL && !b->code)
+			return -EINVAL;
+		if (b->type == G502_BUTTON_MACRO && b->code >= G502_NR_MACROS)
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* A new map for @buttons, or the model's defaults if it's NULL */
+static struct g502_button_map *g502_button_map_alloc(const struct g502_model *model,
+			const struct g502_button *buttons)
+{
+	struct g502_button_map *map;
+	int i;
+
+	map = kzalloc(sizeof(*map), GFP_KERNEL);
+	if (!map)
+		return NULL;
+
+	if (buttons) {
+		memcpy(map->act, buttons, sizeof(map->act));
+	} else if (model->flags & G502_MODEL_EXTRA_BUTTONS) {
+		map->act[G502_BUTTON_BIT_DPI_SHIFT].type = G502_BUTTON_DPI_SHIFT;
+		map->act[G502_BUTTON_BIT_DPI_DOWN].type = G502_BUTTON_DPI_DOWN;
+		map->act[G502_BUTTON_BIT_DPI_UP].type = G502_BUTTON_DPI_UP;
+		map->act[G502_BUTTON_BIT_G6].type = G502_BUTTON_PROFILE_NEXT;
+		map->act[G502_BUTTON_BIT_TILT_LEFT].type = G502_BUTTON_HWHEEL;
+		map->act[G502_BUTTON_BIT_TILT_LEFT].code = (u16)-1;
+		map->act[G502_BUTTON_BIT_TILT_RIGHT].type = G502_BUTTON_HWHEEL;
+		map->act[G502_BUTTON_BIT_TILT_RIGHT].code = 1;
+	}
+
+	for (i = 0; i < G502_NR_BUTTONS; i++)
+		if (map->act[i].type != G502_BUTTON_DEFAULT)
+			map->remapped |= BIT(i);
+	return map;
+}
+
+/* By enum g502_led_effect, KEEP is a fixed zone without a colour */
+static const u8 g502_led_modes[G502_LED_EFFECT_NR] = {
+	[G502_LED_KEEP]			= G_LED_FIXED,
+	[G502_LED_OFF]			= G_LED_OFF,
+	[G502_LED_FIXED]		= G_LED_FIXED,
+	[G502_LED_BREATHING]	= G_LED_BREATHING,
+	[G502_LED_CYCLE]		= G_LED_CYCLE,
 };
 
-static __always_inline void
-__do_fill_report(struct hidpp_report *report_ptr,
-			u8 id, u8 feature_index, u8 function_index, size_t report_length, u8 *params)
+static void g502_profile_from_desc(struct g502_profile *prof,
+			const struct g502_profile_desc *desc)
 {
-	memset(report_ptr, 0, sizeof(*report_ptr));
-	report_ptr->report_id = id;
-	report_ptr->device_index = G502_DEVICE_INDEX_RECEIVER;
-	report_ptr->feature_index = feature_index;
-	report_ptr->funcindex_clientid = function_index | LINUX_KERNEL_SW_ID;
-	if (params)
-		memcpy(id == G502_COMMAND_SHORT_REPORT_ID ?
-				report_ptr->params_s : report_ptr->params_l,
-					params, report_length - 4U);
+	int i;
+
+	prof->dev_report_rate = desc->report_rate;
+	prof->nr_dpi_stages = desc->nr_dpi_stages;
+	prof->dpi_stage = desc->dpi_stage;
+	memset(prof->dpi_stages, 0, sizeof(prof->dpi_stages));
+	for (i = 0; i < desc->nr_dpi_stages; i++)
+		prof->dpi_stages[i] = desc->dpi[i];
+	prof->dev_dpi = prof->dpi_stages[prof->dpi_stage];
+	prof->shift_dpi = desc->shift_dpi;
+	for (i = 0; i < G502_MAX_LED_ZONES; i++) {
+		const struct g502_led *led = &desc->leds[i];
+
+		prof->dev_rgb[i] = led->effect == G502_LED_KEEP ? 0 : led->rgb;
+		prof->dev_led[i].mode = g502_led_modes[led->effect];
+		prof->dev_led[i].brightness = led->brightness;
+		prof->dev_led[i].period_ms = led->period_ms;
+	}
 }
 
-static __always_inline void echo_current_profile_config(struct g502_profile *curr_prof)
+static void g502_profile_to_desc(const struct g502_profile *prof,
+			struct g502_profile_desc *desc)
 {
-    pr_info("current profile\tindex: %d\n\treport rate: %u\n\trgb: %u\n\tdpi: %u\n\t\n",
-                 curr_prof->index, curr_prof->dev_report_rate, curr_prof->dev_rgb, curr_prof->dev_dpi);
+	int i;
+
+	desc->report_rate = prof->dev_report_rate;
+	desc->nr_dpi_stages = prof->nr_dpi_stages;
+	desc->dpi_stage = prof->dpi_stage;
+	for (i = 0; i < prof->nr_dpi_stages; i++)
+		desc->dpi[i] = prof->dpi_stages[i];
+	desc->shift_dpi = prof->shift_dpi;
+	for (i = 0; i < G502_MAX_LED_ZONES; i++) {
+		const struct g502_led_cfg *cfg = &prof->dev_led[i];
+		struct g502_led *led = &desc->leds[i];
+		int effect;
+
+		for (effect = G502_LED_OFF; effect < G502_LED_EFFECT_NR; effect++)
+			if (g502_led_modes[effect] == cfg->mode)
+				break;
+		led->effect = g502_led_unset(cfg, prof->dev_rgb[i]) ? G502_LED_KEEP : effect;
+		led->brightness = cfg->brightness;
+		led->period_ms = cfg->period_ms;
+		led->rgb = prof->dev_rgb[i];
+	}
+	memcpy(desc->buttons, prof->buttons->act, sizeof(desc->buttons));
 }
 
-static __always_inline void
-initalize_profile_struct(struct g502_profile *prof_ptr,
-		u16 report_rate, unsigned int rgb, u16 dpi, int index)
+static long g502_ioctl_get_profiles(struct logi_g502_data *gdv, void __user *argp)
 {
-	prof_ptr->dev_report_rate = report_rate;
-	prof_ptr->dev_rgb = rgb;
-	prof_ptr->dev_dpi = dpi;
-	prof_ptr->index	= index;
+	struct g502_profiles *set;
+	long ret = 0;
+	int i;
+
+	set = kzalloc(sizeof(*set), GFP_KERNEL);
+	if (!set)
+		return -ENOMEM;
+
+	set->version = G502_PROFILES_VERSION;
+	set->nr_profiles = G502_MAX_PROFILES;
+
+	mutex_lock(&gdv->mutex_dev);
+	set->active = gdv->active;
+	for (i = 0; i < G502_MAX_PROFILES; i++)
+		g502_profile_to_desc(&gdv->profiles[i], &set->profiles[i]);
+	mutex_unlock(&gdv->mutex_dev);
+
+	if (copy_to_user(argp, set, sizeof(*set)))
+		ret = -EFAULT;
+	kfree(set);
+	return ret;
 }
 
-static int g502_send_report(struct hid_device *hdev,
-			struct hidpp_report *report)
+static long g502_ioctl_set_profiles(struct logi_g502_data *gdv, void __user *argp)
 {
-	int ret;
-	size_t report_length;
+	struct g502_button_map *maps[G502_MAX_PROFILES] = { NULL };
+	struct g502_profiles *set;
+	long ret;
+	int i;
 
-	spin_lock(&report_work_lock);
-	ret = -ENOMEM;
-	report_length = (report->report_id == G502_COMMAND_SHORT_REPORT_ID
-								? G502_COMMAND_SHORT_SIZE
-								: G502_COMMAND_LONG_SIZE);
-
-	/* There may be underlying issues with the protocol itself, that
-	 * are yield back in the response packet, so we should be able to
-	 * examine packets in the future
-	 */
-	ret = hid_hw_raw_request(hdev, report->report_id, (u8 *)report,
-			report_length, HID_OUTPUT_REPORT, HID_REQ_SET_REPORT);
-	if (ret < 0) {
-		hid_err(hdev,
-			"%s: cannot issue hid raw request (%d)\n", __func__, ret);
+	set = memdup_user(argp, sizeof(*set));
+	if (IS_ERR(set))
+		return PTR_ERR(set);
+
+	ret = -EINVAL;
+	if (set->version != G502_PROFILES_VERSION || !set->nr_profiles ||
+			set->nr_profiles > G502_MAX_PROFILES)
+		goto out;
+	if (set->active != G502_KEEP_ACTIVE && set->active >= G502_MAX_PROFILES)
 		goto out;
+	for (i = 0; i < set->nr_profiles; i++) {
+		ret = g502_profile_desc_check(gdv, &set->profiles[i]);
+		if (ret)
+			goto out;
+	}
+
+	ret = -ENOMEM;
+	for (i = 0; i < set->nr_profiles; i++) {
+		maps[i] = g502_button_map_alloc(gdv->model, set->profiles[i].buttons);
+		if (!maps[i])
+			goto out;
+	}
+
+	mutex_lock(&gdv->mutex_dev);
+	for (i = 0; i < set->nr_profiles; i++) {
+		g502_profile_from_desc(&gdv->profiles[i], &set->profiles[i]);
+		g502_encode_profile(gdv, &gdv->profiles[i]);
+		swap(gdv->profiles[i].buttons, maps[i]);
+	}
+	g502_publish_profile(gdv, g502_active_profile(gdv));
+	mutex_unlock(&gdv->mutex_dev);
+
+	/* The old maps, the event path may still be looking at one */
+	for (i = 0; i < set->nr_profiles; i++) {
+		kfree_rcu(maps[i], rcu);
+		maps[i] = NULL;
 	}
 
-	ret = 0;
+	if (set->active != G502_KEEP_ACTIVE) {
+		g502_select_profile(gdv, set->active);
+		flush_work(&gdv->switch_work);
+	}
 
+	/* Whatever the switch hasn't sent yet, and its ack */
+	ret = g502_config_flush(gdv);
 out:
-	spin_unlock(&report_work_lock);
+	for (i = 0; i < G502_MAX_PROFILES; i++)
+		kfree(maps[i]);
+	kfree(set);
 	return ret;
 }
 
-/* Sends out command to get the current device's config to be caught
- * in raw_event and be stored in our device's private structure.
- */
-static void g502_refresh_gdv_config(struct hid_device *hdev)
+/* Check @m and turn it into bytecode. Keys left down are released at the end. */
+static struct g502_macro_prog *g502_macro_compile(const struct g502_macro *m)
 {
-	struct logi_g502_data *gdv = hid_get_drvdata(hdev);
-	struct usb_interface *intf = to_usb_interface(hdev->dev.parent);
+	DECLARE_BITMAP(down, KEY_CNT);
+	struct g502_macro_prog *prog;
+	unsigned int nr_ops = 0, pc = 0;
+	u32 delay;
+	int i, code;
 
-	if (intf->cur_altsetting->desc.bInterfaceNumber == 0)
-		return;
+	BUILD_BUG_ON(KEY_MAX > 0x3ff);
 
-	__do_fill_report(&gdv->report, G502_COMMAND_SHORT_REPORT_ID,
-		G502_FEATURE_REPORT_RATE, G502_GET_REPORT_RATE,
-		G502_COMMAND_SHORT_SIZE, NULL);
-	g502_send_report(hdev, &gdv->report);
+	if (m->nr_steps > G502_MACRO_MAX_STEPS)
+		return ERR_PTR(-EINVAL);
 
-	__do_fill_report(&gdv->report, G502_COMMAND_SHORT_REPORT_ID,
-		G502_FEATURE_DPI, G502_GET_DPI, G502_COMMAND_SHORT_SIZE, NULL);
-	g502_send_report(hdev, &gdv->report);
+	bitmap_zero(down, KEY_CNT);
+	for (i = 0; i < m->nr_steps; i++) {
+		const struct g502_macro_step *step = &m->steps[i];
 
-	/* TODO: Add RGB */
+		if (step->delay_us > G502_MACRO_MAX_DELAY_US)
+			return ERR_PTR(-EINVAL);
+
+		switch (step->action) {
+		case G502_MACRO_KEY_DOWN:
+			if (!g502_key_remappable(step->code) ||
+					__test_and_set_bit(step->code, down))
+				return ERR_PTR(-EINVAL);
+			break;
+		case G502_MACRO_KEY_UP:
+			if (!g502_key_remappable(step->code) ||
+					!__test_and_clear_bit(step->code, down))
+				return ERR_PTR(-EINVAL);
+			break;
+		case G502_MACRO_WAIT:
+			break;
+		default:
+			return ERR_PTR(-EINVAL);
+		}
+		nr_ops += max(1U, DIV_ROUND_UP(step->delay_us, G502_MOP_MAX_DELAY));
+	}
+	nr_ops += bitmap_weight(down, KEY_CNT);
+
+	prog = kzalloc(struct_size(prog, ops, nr_ops), GFP_KERNEL);
+	if (!prog)
+		return ERR_PTR(-ENOMEM);
+
+	for (i = 0; i < m->nr_steps; i++) {
+		const struct g502_macro_step *step = &m->steps[i];
+
+		delay = step->delay_us;
+		prog->ops[pc++] = G502_MOP(step->action,
+				step->action == G502_MACRO_WAIT ? 0 : step->code,
+				min(delay, G502_MOP_MAX_DELAY));
+		while (delay > G502_MOP_MAX_DELAY) {
+			delay -= G502_MOP_MAX_DELAY;
+			prog->ops[pc++] = G502_MOP(G502_MACRO_WAIT, 0,
+					min(delay, G502_MOP_MAX_DELAY));
+		}
+	}
+	for_each_set_bit(code, down, KEY_CNT)
+		prog->ops[pc++] = G502_MOP(G502_MACRO_KEY_UP, code, 0);
+
+	prog->nr_ops = pc;
+	return prog;
 }
 
-/* Generic function to set current device's config to values passed as arguments.
- * Pass 0 as one of the arguments if you don't desire to change that argument.
- */
-static int g502_update_device_config(struct hid_device *hdev, u16 report_rate,
-			u16 dpi, unsigned int rgb)
+static long g502_ioctl_set_macro(struct logi_g502_data *gdv, void __user *argp)
 {
-	u8 __maybe_unused params[G502_COMMAND_LONG_SIZE - 4U] = { 0 };
-	struct logi_g502_data *gdv = hid_get_drvdata(hdev);
-	// RGB unused rgb_s = rgb_to_struct_rgb(rgb);
+	struct g502_macro_prog *prog = NULL;
+	struct g502_macro *m;
+	unsigned long flags;
+	bool playing;
+	long ret = 0;
 
-	if (report_rate)
-	{
-		params[0] = report_rate;
-		__do_fill_report(&gdv->report, G502_COMMAND_SHORT_REPORT_ID,
-							G502_FEATURE_REPORT_RATE, G502_SET_REPORT_RATE,
-							G502_COMMAND_SHORT_SIZE, params);
-		g502_send_report(hdev, &gdv->report);
-	}
+	m = memdup_user(argp, sizeof(*m));
+	if (IS_ERR(m))
+		return PTR_ERR(m);
 
-	if (dpi)
-	{
-		params[0] = 0; /* Sensor idx */
-		params[1] = (u8)((dpi >> 8) & 0xFF);
-		params[2] = (u8)((dpi) & 0xFF);
-		__do_fill_report(&gdv->report, G502_COMMAND_SHORT_REPORT_ID,
-							G502_FEATURE_DPI, G502_SET_DPI,
-							G502_COMMAND_SHORT_SIZE, params);
-		g502_send_report(hdev, &gdv->report);
+	if (m->index >= G502_NR_MACROS) {
+		ret = -EINVAL;
+		goto out;
+	}
+	if (m->nr_steps) {
+		prog = g502_macro_compile(m);
+		if (IS_ERR(prog)) {
+			ret = PTR_ERR(prog);
+			goto out;
+		}
 	}
 
-	/* Fetch in back the values we just submitted
-	 * for them to be in gdv */
-	g502_refresh_gdv_config(hdev);
+	mutex_lock(&gdv->mutex_dev);
+	/* The player only looks at macros under the lock, and the queue
+	 * holds indexes, so queued triggers just play the new one. Only
+	 * the old one playing has to go, along with the keys it holds.
+	 * Skipped after the swap, a trigger queued for it plays the new one. */
+	spin_lock_irqsave(&gdv->macro_lock, flags);
+	playing = gdv->macro_prog && gdv->macro_prog == gdv->macros[m->index];
+	swap(gdv->macros[m->index], prog);
+	if (playing)
+		__g502_macro_skip(gdv);
+	spin_unlock_irqrestore(&gdv->macro_lock, flags);
+	mutex_unlock(&gdv->mutex_dev);
 
-	return 0;
+	kfree(prog);
+out:
+	kfree(m);
+	return ret;
 }
 
-/* Switch profiles on BTN_9 Click interrupt. */
-static int g502_switch_profile(struct hid_device *hdev)
+/* Doesn't wait, the confirmation comes through poll() and a uevent */
+static long g502_ioctl_select_profile(struct logi_g502_data *gdv, u32 __user *argp)
 {
-	struct logi_g502_data *gdv = hid_get_drvdata(hdev);
+	u32 index;
 
-	if (unlikely(list_empty(&gdv->profiles_list)))
+	if (get_user(index, argp))
+		return -EFAULT;
+	if (index >= G502_MAX_PROFILES)
 		return -EINVAL;
+	if (!READ_ONCE(gdv->initialized))
+		return -EAGAIN;
 
-	/* Circular means it returns the _first_ element if
-		 gdv->current_prof->entry is the last one. */
-	gdv->current_prof = list_next_entry_circular(gdv->current_prof,
-							&gdv->profiles_list, entry);
-	g502_update_device_config(hdev, gdv->current_prof->dev_report_rate,
-			gdv->current_prof->dev_dpi, gdv->current_prof->dev_rgb);
+	return g502_select_profile(gdv, index);
+}
 
-	echo_current_profile_config(gdv->current_prof);
-	return 0;
+static long g502_dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct g502_file *gf = file->private_data;
+	void __user *argp = (void __user *)arg;
+
+	switch (cmd) {
+	case G502_IOC_GET_PROFILES:
+		return g502_ioctl_get_profiles(gf->gdv, argp);
+	case G502_IOC_SET_PROFILES:
+		if (!(file->f_mode & FMODE_WRITE))
+			return -EBADF;
+		return g502_ioctl_set_profiles(gf->gdv, argp);
+	case G502_IOC_SET_MACRO:
+		if (!(file->f_mode & FMODE_WRITE))
+			return -EBADF;
+		return g502_ioctl_set_macro(gf->gdv, argp);
+	case G502_IOC_SELECT_PROFILE:
+		if (!(file->f_mode & FMODE_WRITE))
+			return -EBADF;
+		return g502_ioctl_select_profile(gf->gdv, argp);
+	default:
+		return -ENOTTY;
+	}
 }
 
-/* Handle the regular mouse events, e.g.
- * support horizontal scrolling (tilt wheel left/right) */
-static int g502_handle_regular_event(struct hid_device *hdev,
-			struct input_dev *input, u8 *data)
+static const struct file_operations g502_dev_fops = {
+	.owner = THIS_MODULE,
+	.open = g502_dev_open,
+	.release = g502_dev_release,
+	.unlocked_ioctl = g502_dev_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.mmap = g502_dev_mmap,
+	.poll = g502_dev_poll,
+};
+
+/* Per-interface part of probe, nothing here talks to the device */
+static int g502_init_drvdata(struct hid_device *hdev)
 {
-	if (input == NULL)
-		return 1;
+	struct g502_intf *gi = hid_get_drvdata(hdev);
+	struct logi_g502_data *gdv = gi->gdv;
+	struct hid_input *hidinput;
+
+	if (list_empty(&hdev->inputs))
+		return -EINVAL;
 
-	hid_info(hdev, "%x\n", data[1]);
+	hidinput = list_first_entry(&hdev->inputs, struct hid_input, list);
+	gi->input_dev = hidinput->input;
 
-	/* Wheel cmds is one byte after buttons, except middle-click. */
-	if (data[1] & 0x2) { // LEFT
-		input_report_rel(input, REL_HWHEEL, -1);
-		input_report_rel(input, REL_HWHEEL_HI_RES,
-				-120);
-	} else if (data[1] & 0x4) { // RIGHT
-		input_report_rel(input, REL_HWHEEL, 1);
-		input_report_rel(input, REL_HWHEEL_HI_RES,
-				120);
-	} else if (data[1] & 0x1) { // G6
-		return g502_switch_profile(hdev);
+	/* Until @init_work is done these show what is about to be applied */
+	if (g502_is_hidpp_intf(hdev)) {
+		if (sysfs_create_group(&hdev->dev.kobj, &g502_group) < 0)
+		{
+			hid_err(hdev, "%s: failed to create sysfs attrs\n", __func__);
+			return -EFAULT;
+		}
+	} else {
+		mutex_lock(&gdv->mutex_dev);
+		WRITE_ONCE(gdv->input_dev, gi->input_dev);
+		mutex_unlock(&gdv->mutex_dev);
 	}
 
-// sync_out:
-	input_sync(input);
 	return 0;
 }
 
-/* Only 9 programmable buttons, instead of 16 */
-static __u8 *g502_report_fixup(struct hid_device *hdev,
-				__u8 *rdesc, unsigned int *rsize)
+/* Host mode: on-board profiles off, the driver switches them. Called with
+ * @mutex_dev held. */
+static void g502_host_mode_apply(struct logi_g502_data *gdv)
 {
-	/* rdesc[15] = Usage Maximum, rdesc[21] = Report Count */
-	if (*rsize == 67 && rdesc[15] == 16 && rdesc[21] == 16) {
-		hid_info(hdev, "fixing up g502 hero report descriptor\n");
-		rdesc[15] = 0x09;
-
-		/* Seriously, hid_irq_in breaks when rdesc[21] is changed,
-		 * with "input irq status -75 (E-OVERFLOW) value". I _literally_ have no clue why.
-		 * Figure it out, but for now leave it as is.
-		 */
+	u8 params[G502_COMMAND_LONG_SIZE - 4U] = { 0 };
+	struct hid_device *hdev = gdv->cmdq.hdev;
+	struct hidpp_report report;
+	int ret;
 
-		// rdesc[21] = 0x09;
+	/* Disable on-board profiles support on device entry */
+	if (g502_has_feature(gdv, G502_F_ON_BOARD_PROFILES)) {
+		params[0] = G502_ON_BOARD_PROFILES_OFF;
+		__do_fill_report(&report, G502_COMMAND_SHORT_REPORT_ID,
+								gdv->features[G502_F_ON_BOARD_PROFILES], G502_CONTROL_ON_BOARD_PROFILES,
+								G502_COMMAND_SHORT_SIZE, params);
+		ret = g502_send_report(gdv, &report, NULL);
+		if (ret < 0)
+			hid_warn(hdev, "%s: couldn't disable on-board profiles (%d)\n",
+					__func__, ret);
 	}
 
-	return rdesc;
+	/* Learn what the device is running, then only push what differs.
+	 * Anything changed through sysfs or G6 meanwhile is included. */
+	if (g502_refresh_gdv_config(gdv) < 0)
+		hid_warn(hdev, "%s: couldn't read the device's config\n", __func__);
+	gdv->config_retries = 0;
+	ret = g502_update_device_config(gdv, g502_active_profile(gdv), true);
+	g502_config_retry(gdv, ret);
 }
 
-#define g502_map_key_clear(c)  hid_map_usage_clear(hi, usage, bit, max, EV_KEY, (c))
+/* Push out whatever was held back while suspended */
+static void g502_pm_kick(struct logi_g502_data *gdv)
+{
+	unsigned long flags;
+	bool pending;
 
-/* All buttons must be mapped correctly. We only map G6,
- * to BTN_9 for it to be used with profile changes at @switch_profile
- * whenever BTN_9 is pressed.
- */
-static int g502_input_mapping(struct hid_device *hdev, struct hid_input *hi,
-		struct hid_field *field, struct hid_usage *usage,
-		unsigned long **bit, int *max)
+	spin_lock_irqsave(&gdv->switch_lock, flags);
+	pending = gdv->pending >= 0;
+	spin_unlock_irqrestore(&gdv->switch_lock, flags);
+
+	if (pending)
+		schedule_work(&gdv->switch_work);
+	schedule_delayed_work(&gdv->config_work, 0);
+	/* The idle timeout starts over, a wake pending on suspend is redone */
+	WRITE_ONCE(gdv->idle_stamp, jiffies);
+	if (READ_ONCE(gdv->idle))
+		schedule_work(&gdv->wake_work);
+	else if (READ_ONCE(gdv->idle_timeout_ms))
+		schedule_delayed_work(&gdv->idle_work,
+				msecs_to_jiffies(READ_ONCE(gdv->idle_timeout_ms)));
+}
+
+/* After a USB reset the mouse is back on its firmware defaults. The
+ * feature table is still good, so only the config is redone: whatever
+ * differs from what the device reports now is sent again. */
+static void g502_resume_work(struct work_struct *work)
 {
-	struct usb_interface *intf = to_usb_interface(hdev->dev.parent);
+	struct logi_g502_data *gdv = container_of(work, struct logi_g502_data,
+							resume_work);
+	unsigned long flags;
 
-	if ((usage->hid & HID_USAGE_PAGE) != HID_UP_BUTTON)
-		return 0;
-	if (intf->cur_altsetting->desc.bInterfaceNumber == 1)
-		return 0;
+	mutex_lock(&gdv->mutex_dev);
+	/* Not there yet, @init_work does it all */
+	if (!gdv->initialized)
+		goto out;
 
-	switch (usage->hid & HID_USAGE)
-	{
-	case 9: g502_map_key_clear(BTN_9); break;
-	default: return 0;
-	}
+	write_seqlock_irqsave(&gdv->state_lock, flags);
+	gdv->dev_state.valid = 0;
+	write_sequnlock_irqrestore(&gdv->state_lock, flags);
+	/* Whatever rate the reset left, the config below sets the profile's */
+	WRITE_ONCE(gdv->idle, false);
 
-	return 1;
+	if (!gdv->onboard)
+		g502_host_mode_apply(gdv);
+	else if (g502_onboard_enable(gdv))
+		hid_warn(gdv->cmdq.hdev, "%s: couldn't restore on-board mode\n", __func__);
+out:
+	mutex_unlock(&gdv->mutex_dev);
+	g502_pm_kick(gdv);
 }
 
-/*
- * Parse the hidpp_report contents we received.
- *
- * SET_REPORT response is empty, probably just a handshake,
- * because that's how the protocol works. Now, the actual data
- * comes as USB_INTERRUPT, meaning that HID I/O are independent
- * from each other. We validate it and store the contents.
- */
-static int g502_raw_event(struct hid_device *hdev,
-		struct hid_report *report, u8 *data, int size)
+/* The HID++ side of the initialization: on-board mode, feature discovery
+ * and the initial config. It runs off the probe path so a slow mouse
+ * doesn't hold back the enumeration of everything else on the bus.
+ * Only scheduled once the HID++ interface is bound, so it runs once per
+ * mouse and not once per interface. */
+static void g502_init_device_work(struct work_struct *work)
 {
-	struct hidpp_report *response = (struct hidpp_report *)data;
-	struct logi_g502_data *gdv = hid_get_drvdata(hdev);
-	struct input_dev *input = gdv->input_dev;
-	u8 function_idx;
-
-	/* Regular events */
-	if (size == 8)
-		return g502_handle_regular_event(hdev, input, data);
-
-	/* We always need a LONG report, save resources. */
-	if (response->report_id !=
-		G502_COMMAND_LONG_REPORT_ID ||
-		 	size != G502_COMMAND_LONG_SIZE)
-		return 1;
-
-	/* We use our mutex do indicate whether a new report can be passed */
-	if (mutex_is_locked(&gdv->mutex_dev))
-		return 1;
+	struct logi_g502_data *gdv = container_of(work, struct logi_g502_data,
+							init_work);
+	struct hid_device *hdev = gdv->cmdq.hdev;
 
 	mutex_lock(&gdv->mutex_dev);
-	function_idx = response->funcindex_clientid & ~LINUX_KERNEL_SW_ID;
-	switch (response->feature_index)
-	{
-	case G502_FEATURE_REPORT_RATE:
-		if (function_idx == G502_GET_REPORT_RATE)
-			gdv->current_prof->dev_report_rate =
-					report_rate_htd(response->params_l[0]);
-		break;
-	case G502_FEATURE_DPI:
-		if (function_idx == G502_GET_DPI)
-			gdv->current_prof->dev_dpi = (u16)(response->params_l[1] << 8) |
-					(response->params_l[2]);
-		break;
-	case G502_FEATURE_DEVICE_FW:
-		break;
+
+	/* Everything below needs the real feature indexes */
+	if (g502_discover_features(gdv) < 0)
+		hid_warn(hdev, "%s: feature discovery failed, using defaults\n", __func__);
+	/* Nothing writes @gfw from here on, firmware_show() reads it freely */
+	smp_store_release(&gdv->fw_ready, true);
+	g502_encode_profiles(gdv);
+	g502_publish_profile(gdv, g502_active_profile(gdv));
+
+	if (onboard_profiles && g502_has_feature(gdv, G502_F_ON_BOARD_PROFILES)) {
+		int ret = g502_onboard_init(gdv);
+
+		if (!ret)
+			goto out_initialized;
+		hid_warn(hdev, "%s: on-board profiles unavailable (%d), using host mode\n",
+				__func__, ret);
 	}
+
+	g502_host_mode_apply(gdv);
+
+out_initialized:
+	gdv->initialized = true;
 	mutex_unlock(&gdv->mutex_dev);
 
-	return 0;
+	if (READ_ONCE(gdv->idle_timeout_ms))
+		schedule_delayed_work(&gdv->idle_work,
+				msecs_to_jiffies(READ_ONCE(gdv->idle_timeout_ms)));
 }
 
-/* We define a macro to handle the attributes' show operations.
- * as it's simply the same for all. */
-#define G502_ATTR_SHOW(name, feature_uppercase)			       				\
-	static ssize_t name##_show(struct device *dev,			       			\
-			struct device_attribute *attr, char *buf)						\
-	{								       									\
-		struct logi_g502_data *gdv = dev_get_drvdata(dev);					\
-		int ret;															\
-																			\
-		mutex_lock(&gdv->mutex_dev);										\
-		ret = sysfs_emit(buf, "%u\n", gdv->current_prof->dev_##name);		\
-		mutex_unlock(&gdv->mutex_dev);										\
-		return ret;															\
-	}
-
-static ssize_t report_rate_store(struct device *dev,
-	struct device_attribute *attr, const char *buf, size_t count)
+static struct logi_g502_data *g502_device_alloc(struct usb_device *udev,
+			const struct g502_model *model)
 {
-	struct hid_device *hdev = to_hid_device(dev);
-	unsigned __report_rate;
-	u8 report_rate;
+	struct logi_g502_data *gdv;
+	int i;
 
-	if (kstrtouint(buf, 0, &__report_rate))
-		return -EINVAL;
-	if ((report_rate = report_rate_dth(__report_rate)) == 0)
-		return -EINVAL;
+	gdv = kzalloc(sizeof(*gdv), GFP_KERNEL);
+	if (!gdv)
+		return NULL;
+	gdv->misc_id = -1;
 
-	g502_update_device_config(hdev, report_rate, 0, 0);
+	BUILD_BUG_ON(G502_NR_PROFILES != G502_MAX_PROFILES);
+	BUILD_BUG_ON(G502_NR_DPI_STAGES != G502_MAX_DPI_STAGES);
+	BUILD_BUG_ON(G502_NR_LED_ZONES != G502_MAX_LED_ZONES);
 
-	return count;
-}
+	gdv->istats = alloc_percpu(struct g502_input_stats);
+	if (!gdv->istats)
+		goto out_free;
 
-/* TBD */
-static ssize_t dpi_store(struct device *dev,
-	struct device_attribute *attr, const char *buf, size_t count)
-{
-	// struct hid_device *hdev = to_hid_device(dev);
-	// u16 dpi_requested;
+	gdv->ring = vmalloc_user(G502_RING_SIZE);
+	if (!gdv->ring)
+		goto out_free;
+	gdv->ring->version = G502_RING_VERSION;
+	gdv->ring->nr_records = G502_RING_NR_RECORDS;
+	gdv->ring->record_size = sizeof(struct g502_ring_record);
+	gdv->ring->data_offset = G502_RING_DATA_OFFSET;
+	spin_lock_init(&gdv->ring_lock);
+	init_waitqueue_head(&gdv->ring_wait);
 
-	// if (kstrtou16(buf, 0, &dpi_requested))
-	// 	return -EINVAL;
-	// if (0 > dpi_requested || dpi_requested > G502_MAX_RESOLUTION_DPI)
-	// 	return -EINVAL;
+	gdv->misc_id = ida_alloc(&g502_ida, GFP_KERNEL);
+	if (gdv->misc_id < 0)
+		goto out_free;
+	gdv->misc.name = kasprintf(GFP_KERNEL, "g502-%d", gdv->misc_id);
+	if (!gdv->misc.name)
+		goto out_free;
+	gdv->misc.fops = &g502_dev_fops;
 
-	// hid_info(hdev, "%u\n", dpi_requested);
+	/* Currently, all profiles must be setup correctly. */
+	initalize_profile_struct(&gdv->profiles[0], 125, 0, 800, 0);
+	initalize_profile_struct(&gdv->profiles[1], 250, 0, 1600, 1);
+	initalize_profile_struct(&gdv->profiles[2], 500, 0, 2400, 2);
+	initalize_profile_struct(&gdv->profiles[3], 1000, 0, 3200, 3);
+	initalize_profile_struct(&gdv->profiles[4], 1000, 0, 6000, 4);
+	for (i = 0; i < G502_MAX_PROFILES; i++) {
+		struct g502_profile *prof = &gdv->profiles[i];
+		int stage;
 
-	// g502_update_device_config(hdev, 0, dpi_requested, 0);
+		prof->dev_dpi = min(prof->dev_dpi, model->max_dpi);
+		for (stage = 0; stage < prof->nr_dpi_stages; stage++)
+			prof->dpi_stages[stage] = min(prof->dpi_stages[stage], model->max_dpi);
+		prof->buttons = g502_button_map_alloc(model, NULL);
+		if (!prof->buttons)
+			goto out_free;
+	}
+	gdv->active = 0;
+	gdv->pending = -1;
 
-	// return count;
-	return count;
+	kref_init(&gdv->ref);
+	gdv->udev = udev;
+	gdv->model = model;
+	memcpy(gdv->features, model->features, sizeof(gdv->features));
+	g502_cmdq_init(&gdv->cmdq, gdv->features);
+	mutex_init(&gdv->mutex_dev);
+	mutex_init(&gdv->state_get_lock);
+	seqlock_init(&gdv->state_lock);
+	spin_lock_init(&gdv->switch_lock);
+	INIT_WORK(&gdv->switch_work, g502_switch_profile_work);
+	atomic_set(&gdv->switch_done, 0);
+	INIT_DELAYED_WORK(&gdv->config_work, g502_config_work);
+	INIT_DELAYED_WORK(&gdv->idle_work, g502_idle_work);
+	INIT_WORK(&gdv->wake_work, g502_wake_work);
+	spin_lock_init(&gdv->dpi_lock);
+	INIT_WORK(&gdv->dpi_work, g502_dpi_work);
+	gdv->idle_report_rate = G502_IDLE_RATE_DEFAULT;
+	spin_lock_init(&gdv->led_lock);
+	atomic_set(&gdv->led_inflight, 0);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(&gdv->led_timer, g502_led_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+	hrtimer_init(&gdv->led_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	gdv->led_timer.function = g502_led_timer;
+#endif
+	spin_lock_init(&gdv->macro_lock);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(&gdv->macro_timer, g502_macro_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+#else
+	hrtimer_init(&gdv->macro_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	gdv->macro_timer.function = g502_macro_timer;
+#endif
+	INIT_WORK(&gdv->init_work, g502_init_device_work);
+	INIT_WORK(&gdv->resume_work, g502_resume_work);
+
+	g502_encode_profiles(gdv);
+	g502_publish_profile(gdv, g502_active_profile(gdv));
+	return gdv;
+
+out_free:
+	for (i = 0; i < G502_MAX_PROFILES; i++)
+		kfree(gdv->profiles[i].buttons);
+	if (gdv->misc_id >= 0)
+		ida_free(&g502_ida, gdv->misc_id);
+	vfree(gdv->ring);
+	free_percpu(gdv->istats);
+	kfree(gdv);
+	return NULL;
 }
 
-G502_ATTR_SHOW(report_rate, REPORT_RATE);
-G502_ATTR_SHOW(dpi, DPI);
+/* Called with @g502_devices_lock held */
+static void g502_device_release(struct kref *ref)
+{
+	struct logi_g502_data *gdv = container_of(ref, struct logi_g502_data, ref);
+	int i;
 
-static DEVICE_ATTR_RW(report_rate);
-static DEVICE_ATTR_RW(dpi);
+	list_del(&gdv->entry);
+	/* Interface 0 may have queued a switch before it went away */
+	cancel_work_sync(&gdv->switch_work);
+	cancel_delayed_work_sync(&gdv->config_work);
+	cancel_work_sync(&gdv->wake_work);
+	cancel_work_sync(&gdv->dpi_work);
+	cancel_delayed_work_sync(&gdv->idle_work);
+	hrtimer_cancel(&gdv->led_timer);
+	hrtimer_cancel(&gdv->macro_timer);
+	for (i = 0; i < G502_NR_MACROS; i++)
+		kfree(gdv->macros[i]);
+	kfree(gdv->misc.name);
+	ida_free(&g502_ida, gdv->misc_id);
+	vfree(gdv->ring);
+	free_percpu(gdv->istats);
+	/* Both interfaces are stopped, nothing reads @btn_map anymore */
+	for (i = 0; i < G502_MAX_PROFILES; i++)
+		kfree(gdv->profiles[i].buttons);
+	kfree(gdv);
+}
 
-static const struct attribute_group g502_group = {
-	.attrs = (struct attribute *[]) {
-		&dev_attr_report_rate.attr,
-		&dev_attr_dpi.attr,
-		NULL,
+/* Finds the data of the mouse @hdev is part of, or sets it up if this is
+ * the first of its interfaces to probe. */
+static struct logi_g502_data *g502_device_get(struct hid_device *hdev,
+			const struct g502_model *model)
+{
+	struct usb_device *udev = hid_to_usb_dev(hdev);
+	struct logi_g502_data *gdv;
+
+	mutex_lock(&g502_devices_lock);
+	list_for_each_entry(gdv, &g502_devices, entry) {
+		if (gdv->udev == udev) {
+			kref_get(&gdv->ref);
+			goto out;
+		}
 	}
-};
 
-static int __init g502_init_drvdata(struct hid_device *hdev)
+	gdv = g502_device_alloc(udev, model);
+	if (gdv)
+		list_add(&gdv->entry, &g502_devices);
+out:
+	mutex_unlock(&g502_devices_lock);
+	return gdv;
+}
+
+static void g502_device_put(struct logi_g502_data *gdv)
 {
-	int i;
-	struct hid_input *hidinput;
-	u8 params[G502_COMMAND_LONG_SIZE - 4U] = { 0 };
-	struct logi_g502_data *gdv = hid_get_drvdata(hdev);
-	struct usb_interface *intf = to_usb_interface(hdev->dev.parent);
+	mutex_lock(&g502_devices_lock);
+	kref_put(&gdv->ref, g502_device_release);
+	mutex_unlock(&g502_devices_lock);
+}
 
-	if (list_empty(&hdev->inputs))
-		return -EINVAL;
+/* Not being able to create the char device isn't fatal, the mouse
+ * and sysfs work without it. */
+static void g502_misc_register(struct logi_g502_data *gdv, struct hid_device *hdev)
+{
+	int ret;
 
-	mutex_init(&gdv->mutex_dev);
-	INIT_LIST_HEAD(&gdv->profiles_list);
+	gdv->misc.minor = MISC_DYNAMIC_MINOR;
+	gdv->misc.parent = &hdev->dev;
+	ret = misc_register(&gdv->misc);
+	if (ret) {
+		hid_warn(hdev, "%s: failed to register %s (%d)\n", __func__,
+				gdv->misc.name, ret);
+		return;
+	}
+	WRITE_ONCE(gdv->misc_registered, true);
+}
 
-	hidinput = list_first_entry(&hdev->inputs, struct hid_input, list);
-	gdv->input_dev = hidinput->input;
+/* The HID++ interface is going away, stop everything that talks through it */
+static void g502_hidpp_detach(struct logi_g502_data *gdv)
+{
+	cancel_work_sync(&gdv->init_work);
+	cancel_work_sync(&gdv->resume_work);
+	cancel_work_sync(&gdv->switch_work);
+	cancel_delayed_work_sync(&gdv->config_work);
+	cancel_work_sync(&gdv->wake_work);
+	cancel_work_sync(&gdv->dpi_work);
+	cancel_delayed_work_sync(&gdv->idle_work);
+	g502_led_stop(gdv);
+	g502_cmdq_stop(&gdv->cmdq);
+	/* Stopping the queue failed whatever the last frame had left */
+	atomic_set(&gdv->led_inflight, 0);
+	debugfs_remove_recursive(gdv->debugfs);
+	gdv->debugfs = NULL;
 
-	/* Currently, all profiles must be allocated and setup correctly. */
-	for (i = 0; i < G502_MAX_PROFILES; i++) {
-		gdv->profiles[i] = devm_kzalloc(&hdev->dev, sizeof(*gdv->current_prof), GFP_KERNEL);
-		if (!gdv->profiles[i])
-			return -EFAULT;
-		list_add(&gdv->profiles[i]->entry, &gdv->profiles_list);
+	if (gdv->misc_registered) {
+		misc_deregister(&gdv->misc);
+		WRITE_ONCE(gdv->misc_registered, false);
+		wake_up_interruptible(&gdv->ring_wait);
 	}
 
-	initalize_profile_struct(gdv->profiles[0], 1, 0, 800, 0);
-	initalize_profile_struct(gdv->profiles[1], 2, 0, 1600, 1);
-	initalize_profile_struct(gdv->profiles[2], 4, 0, 2400, 2);
-	initalize_profile_struct(gdv->profiles[3], 8, 0, 3200, 3);
-	initalize_profile_struct(gdv->profiles[4], 8, 0, 6000, 4);
+	mutex_lock(&gdv->mutex_dev);
+	/* The attributes are gone already, the next bind discovers again */
+	gdv->fw_ready = false;
+	gdv->initialized = false;
+	gdv->onboard = false;
+	WRITE_ONCE(gdv->idle, false);
+	/* Queue and HID++ works are stopped, only @switch_work still checks */
+	WRITE_ONCE(gdv->cmdq.hdev, NULL);
+	mutex_unlock(&gdv->mutex_dev);
 
-	gdv->current_prof = list_first_entry(&gdv->profiles_list,
-							struct g502_profile, entry);
+	/* Interface 0 may have queued one meanwhile, it won't get far */
+	flush_work(&gdv->switch_work);
+}
 
-	if (intf->cur_altsetting->desc.bInterfaceNumber == 1) {
-		if (sysfs_create_group(&hdev->dev.kobj, &g502_group) < 0)
-		{
-			hid_err(hdev, "%s: failed to create sysfs attrs\n", __func__);
-			return -EFAULT;
-		}
-	}
+#ifdef CONFIG_PM
+/* Only the HID++ interface has anything to do, and none of it is done
+ * inline: resume keeps the input going right away and the config follows. */
+static int g502_suspend(struct hid_device *hdev, pm_message_t message)
+{
+	struct logi_g502_data *gdv = g502_hdev_to_gdv(hdev);
 
-	/* Disable on-board profiles support on device entry */
-	params[0] = G502_ON_BOARD_PROFILES_OFF;
-	__do_fill_report(&gdv->report, G502_COMMAND_SHORT_REPORT_ID,
-							G502_FEATURE_ON_BOARD_PROFILES, G502_CONTROL_ON_BOARD_PROFILES,
-							G502_COMMAND_SHORT_SIZE, params);
-	g502_send_report(hdev, &gdv->report);
-	g502_refresh_gdv_config(hdev);
+	if (!g502_is_hidpp_intf(hdev))
+		return 0;
+
+	/* Whatever these had left is still in the profiles, resume sends it */
+	g502_led_stop(gdv);
+	g502_macro_stop(gdv);
+	cancel_work_sync(&gdv->resume_work);
+	cancel_work_sync(&gdv->switch_work);
+	cancel_delayed_work_sync(&gdv->config_work);
+	cancel_work_sync(&gdv->wake_work);
+	cancel_work_sync(&gdv->dpi_work);
+	cancel_delayed_work_sync(&gdv->idle_work);
+	return 0;
+}
+
+/* Still powered, the device kept its config */
+static int g502_resume(struct hid_device *hdev)
+{
+	if (g502_is_hidpp_intf(hdev))
+		g502_pm_kick(g502_hdev_to_gdv(hdev));
+	return 0;
+}
 
+static int g502_reset_resume(struct hid_device *hdev)
+{
+	if (g502_is_hidpp_intf(hdev))
+		schedule_work(&g502_hdev_to_gdv(hdev)->resume_work);
 	return 0;
 }
+#endif
 
 static const struct hid_device_id logitech_g502[] = {
-	{ HID_USB_DEVICE(LOGITECH_VENDOR_ID, G502_HERO_DEVICE_ID) },
+#define G502_MODEL(pid, model) \
+	{ HID_USB_DEVICE(LOGITECH_VENDOR_ID, (pid)), \
+	  .driver_data = (kernel_ulong_t)&g502_models[(model)] }
+	G502_MODEL(G502_HERO_DEVICE_ID, G502_MODEL_G502_HERO),
+	G502_MODEL(G502_SPECTRUM_DEVICE_ID, G502_MODEL_G502_SPECTRUM),
+	G502_MODEL(G403_DEVICE_ID, G502_MODEL_G403),
+	G502_MODEL(G403_HERO_DEVICE_ID, G502_MODEL_G403_HERO),
+	G502_MODEL(G_PRO_DEVICE_ID, G502_MODEL_G_PRO),
+	G502_MODEL(G_PRO_HERO_DEVICE_ID, G502_MODEL_G_PRO_HERO),
+	G502_MODEL(G203_DEVICE_ID, G502_MODEL_G203),
+#undef G502_MODEL
 	{ }
 };
 MODULE_DEVICE_TABLE(hid, logitech_g502);
@@ -423,39 +4021,56 @@ static struct hid_driver g502_hid_driver = {
 	.probe = g502_hero_probe,
 	.remove = g502_hero_remove,
 	.input_mapping = g502_input_mapping,
+	.input_configured = g502_input_configured,
 	.report_fixup = g502_report_fixup,
 	.raw_event = g502_raw_event,
+	.report = g502_report,
+#ifdef CONFIG_PM
+	.suspend = g502_suspend,
+	.resume = g502_resume,
+	.reset_resume = g502_reset_resume,
+#endif
+	.driver = {
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+	},
 };
-module_hid_driver(g502_hid_driver);
 
 static int g502_hero_probe(struct hid_device *hdev,
 			const struct hid_device_id *id)
 {
 	int retval;
+	struct g502_intf *gi;
 	struct logi_g502_data *gdv;
 
 	if (!hid_is_usb(hdev))
 		return -EINVAL;
 
-	gdv = devm_kzalloc(&hdev->dev, sizeof(*gdv), GFP_KERNEL);
+	gi = devm_kzalloc(&hdev->dev, sizeof(*gi), GFP_KERNEL);
+	if (!gi)
+		return -ENOMEM;
+
+	gdv = g502_device_get(hdev, (const struct g502_model *)id->driver_data);
 	if (!gdv) {
 		hid_err(hdev, "%s: couldn't allocate memory for internal structure\n",
 					__func__);
 		return -ENOMEM;
 	}
 
-	hid_set_drvdata(hdev, gdv);
+	gi->gdv = gdv;
+	gi->hdev = hdev;
+	gi->mouse = !g502_is_hidpp_intf(hdev);
+	hid_set_drvdata(hdev, gi);
 
 	retval = hid_parse(hdev);
 	if (retval) {
 		hid_err(hdev, "%s: failed to parse HID\n", __func__);
-		return retval;
+		goto out_put;
 	}
 
 	retval = hid_hw_start(hdev, HID_CONNECT_DEFAULT);
 	if (retval) {
 		hid_err(hdev, "%s: failed to start hw\n", __func__);
-		return retval;
+		goto out_put;
 	}
 
 	retval = hid_hw_open(hdev);
@@ -470,22 +4085,73 @@ static int g502_hero_probe(struct hid_device *hdev,
 	if (retval < 0) {
 		hid_err(hdev, "%s: device's driver data initalization failed\n",
 					__func__);
-		goto out_hw_stop;
+		goto out_hw_close;
 	}
 
+	/* The input device is registered already, the rest can wait */
+	if (g502_is_hidpp_intf(hdev)) {
+		g502_cmdq_start(&gdv->cmdq, hdev);
+		g502_debugfs_init(gdv, hdev);
+		g502_misc_register(gdv, hdev);
+		schedule_work(&gdv->init_work);
+	}
 	return 0;
 
+out_hw_close:
+	hid_hw_close(hdev);
 out_hw_stop:
 	hid_hw_stop(hdev);
+out_put:
+	g502_device_put(gdv);
 	return retval;
 }
 
 static void g502_hero_remove(struct hid_device *hdev)
 {
+	struct g502_intf *gi = hid_get_drvdata(hdev);
+	struct logi_g502_data *gdv = gi->gdv;
+
+	if (g502_is_hidpp_intf(hdev)) {
+		sysfs_remove_group(&hdev->dev.kobj, &g502_group);
+		g502_hidpp_detach(gdv);
+	} else {
+		mutex_lock(&gdv->mutex_dev);
+		WRITE_ONCE(gdv->input_dev, NULL);
+		mutex_unlock(&gdv->mutex_dev);
+		/* Waits for a player that still has the old input device */
+		g502_macro_stop(gdv);
+	}
+
+	hid_hw_close(hdev);
 	hid_hw_stop(hdev);
+	g502_device_put(gdv);
+}
+
+static int __init g502_module_init(void)
+{
+	int ret;
+
+	g502_debugfs_root = debugfs_create_dir("g502", NULL);
+
+	ret = hid_register_driver(&g502_hid_driver);
+	if (ret)
+		debugfs_remove_recursive(g502_debugfs_root);
+	return ret;
+}
+module_init(g502_module_init);
+
+static void __exit g502_module_exit(void)
+{
+	hid_unregister_driver(&g502_hid_driver);
+	debugfs_remove_recursive(g502_debugfs_root);
+	g502_feature_cache_free();
 }
+module_exit(g502_module_exit);
 
 MODULE_AUTHOR("Roi L");
 MODULE_LICENSE("GPL v2");
 MODULE_ALIAS("hid:logitech-g502-hero");
-MODULE_DESCRIPTION("HID Logitech G502 Hero Driver");
\ No newline at end of file
+MODULE_DESCRIPTION("HID Logitech G502 Hero Driver");
+#ifdef G502_KUNIT_TEST
+#include "g502_kunit.c"
+#endif
@@ -0,0 +1,644 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * KUnit suite, built into the module with `make G502_KUNIT=y` on a kernel
+ * with CONFIG_KUNIT. Included at the end of g502.c, so it sees the
+ * driver's statics. Reports are fed through g502_raw_event() on a fake
+ * hid_device, HID++ commands are put in flight by hand instead of being
+ * sent. Run with kunit.py or by loading the module, results in dmesg.
+ */
+
+#include <kunit/test.h>
+
+#define G502_TEST_BENCH_EVENTS	100000
+
+/* Recorded reports of a G502 Hero, interface 0 */
+static const u8 g502_report_motion[8] = { 0x00, 0x00, 0x05, 0x00, 0xfd, 0xff, 0x00, 0x00 };
+static const u8 g502_report_tilt_left[8] = { 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+static const u8 g502_report_g6[8] = { 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+static const u8 g502_report_dpi_up[8] = { 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+static const u8 g502_report_dpi_shift[8] = { 0x20, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+static const u8 g502_report_idle[8] = { 0 };
+
+/* And its original mouse descriptor, see g502_report_fixup() */
+static const u8 g502_test_rdesc[67] = {
+	0x05, 0x01, 0x09, 0x02, 0xa1, 0x01, 0x09, 0x01, 0xa1, 0x00, 0x05, 0x09,
+	0x19, 0x01, 0x29, 0x10, 0x15, 0x00, 0x25, 0x01, 0x95, 0x10, 0x75, 0x01,
+	0x81, 0x02, 0x05, 0x01, 0x16, 0x01, 0x80, 0x26, 0xff, 0x7f, 0x75, 0x10,
+	0x95, 0x02, 0x09, 0x30, 0x09, 0x31, 0x81, 0x06, 0x15, 0x81, 0x25, 0x7f,
+	0x75, 0x08, 0x95, 0x01, 0x09, 0x38, 0x81, 0x06, 0x05, 0x0c, 0x0a, 0x38,
+	0x02, 0x95, 0x01, 0x81, 0x06, 0xc0, 0xc0,
+};
+
+struct g502_test_ctx {
+	struct logi_g502_data *gdv;
+	struct hid_device *hdev; /* Interface 0 */
+	struct hid_device *hidpp; /* Interface 1 */
+	struct g502_intf gi;
+	struct g502_intf gi_hidpp;
+	struct input_dev *input;
+};
+
+static int g502_test_init(struct kunit *test)
+{
+	struct g502_test_ctx *ctx;
+	int ret;
+
+	ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, ctx);
+	ctx->hdev = kunit_kzalloc(test, sizeof(*ctx->hdev), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, ctx->hdev);
+	ctx->hidpp = kunit_kzalloc(test, sizeof(*ctx->hidpp), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, ctx->hidpp);
+
+	ctx->gdv = g502_device_alloc(NULL, &g502_models[G502_MODEL_G502_HERO]);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, ctx->gdv);
+	/* Never was on g502_devices, g502_device_release() unlinks it anyway */
+	INIT_LIST_HEAD(&ctx->gdv->entry);
+	/* The queue stays dead, it only needs a device for its tracepoints */
+	ctx->gdv->cmdq.hdev = ctx->hidpp;
+
+	/* Events go nowhere, but only a registered device takes them */
+	ctx->input = input_allocate_device();
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, ctx->input);
+	ctx->input->name = "g502 kunit";
+	input_set_capability(ctx->input, EV_KEY, BTN_LEFT);
+	input_set_capability(ctx->input, EV_REL, REL_X);
+	input_set_capability(ctx->input, EV_REL, REL_Y);
+	input_set_capability(ctx->input, EV_REL, REL_HWHEEL);
+	input_set_capability(ctx->input, EV_REL, REL_HWHEEL_HI_RES);
+	ret = input_register_device(ctx->input);
+	if (ret)
+		input_free_device(ctx->input);
+	KUNIT_ASSERT_EQ(test, ret, 0);
+
+	ctx->gi.gdv = ctx->gdv;
+	ctx->gi.hdev = ctx->hdev;
+	ctx->gi.input_dev = ctx->input;
+	ctx->gi.mouse = true;
+	hid_set_drvdata(ctx->hdev, &ctx->gi);
+	ctx->gdv->input_dev = ctx->input;
+
+	ctx->gi_hidpp.gdv = ctx->gdv;
+	ctx->gi_hidpp.hdev = ctx->hidpp;
+	hid_set_drvdata(ctx->hidpp, &ctx->gi_hidpp);
+
+	test->priv = ctx;
+	return 0;
+}
+
+static void g502_test_exit(struct kunit *test)
+{
+	struct g502_test_ctx *ctx = test->priv;
+
+	g502_macro_stop(ctx->gdv);
+	ctx->gdv->input_dev = NULL;
+	input_unregister_device(ctx->input);
+	g502_device_put(ctx->gdv);
+}
+
+/* Feed a copy, raw_event may rewrite it */
+static int g502_test_event(struct g502_test_ctx *ctx, struct hid_device *hdev,
+			const u8 *report, u8 *data, int size)
+{
+	memcpy(data, report, size);
+	return g502_raw_event(hdev, NULL, data, size);
+}
+
+static u64 g502_test_istat(struct logi_g502_data *gdv, size_t offset)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += *(u64 *)((u8 *)per_cpu_ptr(gdv->istats, cpu) + offset);
+	return sum;
+}
+
+/* Put a command in flight the way g502_cmdq_send_work() would, minus the
+ * actual send. The caller owns one reference, the queue another. */
+static struct g502_cmd *g502_test_inflight(struct kunit *test,
+			struct logi_g502_data *gdv, const struct hidpp_report *report)
+{
+	struct g502_cmdq *q = &gdv->cmdq;
+	struct g502_cmd *cmd;
+	unsigned long flags;
+
+	cmd = g502_cmd_alloc(GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, cmd);
+	cmd->report = *report;
+	cmd->context = gdv;
+	cmd->submitted = ktime_get();
+
+	spin_lock_irqsave(&q->lock, flags);
+	cmd->sw_id = g502_cmdq_get_swid(q);
+	cmd->report.funcindex_clientid |= cmd->sw_id;
+	list_add_tail(&cmd->entry, &q->inflight);
+	q->nr_inflight++;
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	kref_get(&cmd->ref);
+	KUNIT_ASSERT_NE(test, cmd->sw_id, 0);
+	return cmd;
+}
+
+static void g502_test_fill_report(struct kunit *test)
+{
+	u8 params[G502_COMMAND_LONG_SIZE - 4U];
+	struct hidpp_report report;
+	int i;
+
+	for (i = 0; i < sizeof(params); i++)
+		params[i] = 0xa0 + i;
+
+	__do_fill_report(&report, G502_COMMAND_SHORT_REPORT_ID, G502_FEATURE_REPORT_RATE,
+			G502_SET_REPORT_RATE, G502_COMMAND_SHORT_SIZE, params);
+	KUNIT_EXPECT_EQ(test, report.report_id, G502_COMMAND_SHORT_REPORT_ID);
+	KUNIT_EXPECT_EQ(test, report.device_index, G502_DEVICE_INDEX_RECEIVER);
+	KUNIT_EXPECT_EQ(test, report.feature_index, G502_FEATURE_REPORT_RATE);
+	/* The SW ID is the queue's business */
+	KUNIT_EXPECT_EQ(test, report.funcindex_clientid, G502_SET_REPORT_RATE);
+	KUNIT_EXPECT_EQ(test, memcmp(report.params_s, params, sizeof(report.params_s)), 0);
+	/* Only the short report's params are copied */
+	KUNIT_EXPECT_EQ(test, report.params_l[sizeof(report.params_s)], 0);
+	KUNIT_EXPECT_EQ(test, g502_report_length(&report), G502_COMMAND_SHORT_SIZE);
+
+	__do_fill_report(&report, G502_COMMAND_LONG_REPORT_ID, G502_FEATURE_COLOR_LED_EFFECTS,
+			G502_CHANGE_LED_MODE, G502_COMMAND_LONG_SIZE, params);
+	KUNIT_EXPECT_EQ(test, report.report_id, G502_COMMAND_LONG_REPORT_ID);
+	KUNIT_EXPECT_EQ(test, report.feature_index, G502_FEATURE_COLOR_LED_EFFECTS);
+	KUNIT_EXPECT_EQ(test, memcmp(report.params_l, params, sizeof(report.params_l)), 0);
+	KUNIT_EXPECT_EQ(test, g502_report_length(&report), G502_COMMAND_LONG_SIZE);
+
+	__do_fill_report(&report, G502_COMMAND_SHORT_REPORT_ID, HIDPP_PAGE_ROOT_IDX,
+			CMD_ROOT_GET_FEATURE, G502_COMMAND_SHORT_SIZE, NULL);
+	for (i = 0; i < sizeof(report.params_l); i++)
+		KUNIT_EXPECT_EQ(test, report.params_l[i], 0);
+}
+
+static void g502_test_report_rates(struct kunit *test)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(g502_report_rates); i++) {
+		KUNIT_EXPECT_EQ(test, report_rate_dth(g502_report_rates[i].hz),
+				g502_report_rates[i].code);
+		KUNIT_EXPECT_EQ(test, report_rate_htd(g502_report_rates[i].code),
+				g502_report_rates[i].hz);
+	}
+
+	KUNIT_EXPECT_EQ(test, report_rate_dth(125), 0x1);
+	KUNIT_EXPECT_EQ(test, report_rate_htd(0x8), 1000);
+	KUNIT_EXPECT_EQ(test, report_rate_dth(0), 0);
+	KUNIT_EXPECT_EQ(test, report_rate_dth(333), 0);
+	KUNIT_EXPECT_EQ(test, report_rate_htd(0x3), 0);
+}
+
+static void g502_test_rdesc_fixup(struct kunit *test)
+{
+	struct g502_test_ctx *ctx = test->priv;
+	u8 rdesc[sizeof(g502_test_rdesc)];
+	unsigned int rsize = sizeof(rdesc);
+	u8 *fixed;
+
+	memcpy(rdesc, g502_test_rdesc, sizeof(rdesc));
+	fixed = g502_report_fixup(ctx->hdev, rdesc, &rsize);
+	KUNIT_EXPECT_PTR_EQ(test, fixed, (u8 *)g502_hero_rdesc_fixed);
+	KUNIT_EXPECT_EQ(test, rsize, sizeof(g502_hero_rdesc_fixed));
+
+	/* Anything else is left alone */
+	rsize = sizeof(rdesc) - 1;
+	KUNIT_EXPECT_PTR_EQ(test, g502_report_fixup(ctx->hdev, rdesc, &rsize), rdesc);
+	KUNIT_EXPECT_EQ(test, rsize, sizeof(rdesc) - 1);
+	KUNIT_EXPECT_EQ(test, memcmp(rdesc, g502_test_rdesc, sizeof(rdesc)), 0);
+
+	/* Same layout, another firmware: only the usages are patched */
+	rsize = sizeof(rdesc);
+	rdesc[47] = 0x7e;
+	KUNIT_EXPECT_PTR_EQ(test, g502_report_fixup(ctx->hdev, rdesc, &rsize), rdesc);
+	KUNIT_EXPECT_EQ(test, rsize, sizeof(rdesc));
+	KUNIT_EXPECT_EQ(test, rdesc[15], 0x09);
+	KUNIT_EXPECT_EQ(test, rdesc[21], 0x10);
+}
+
+static void g502_test_motion(struct kunit *test)
+{
+	struct g502_test_ctx *ctx = test->priv;
+	u8 data[8];
+
+	KUNIT_EXPECT_EQ(test, g502_test_event(ctx, ctx->hdev, g502_report_motion,
+			data, sizeof(data)), 1);
+	KUNIT_EXPECT_EQ(test, memcmp(data, g502_report_motion, sizeof(data)), 0);
+	KUNIT_EXPECT_EQ(test, g502_test_istat(ctx->gdv,
+			offsetof(struct g502_input_stats, processed)), 1);
+	KUNIT_EXPECT_EQ(test, g502_test_istat(ctx->gdv,
+			offsetof(struct g502_input_stats, passed)), 1);
+}
+
+/* Remapped bits are acted on and hidden from hid-core */
+static void g502_test_tilt(struct kunit *test)
+{
+	struct g502_test_ctx *ctx = test->priv;
+	u8 data[8];
+
+	KUNIT_EXPECT_EQ(test, g502_test_event(ctx, ctx->hdev, g502_report_tilt_left,
+			data, sizeof(data)), 1);
+	KUNIT_EXPECT_EQ(test, data[1], 0);
+	KUNIT_EXPECT_EQ(test, ctx->gdv->btn_last, BIT(G502_BUTTON_BIT_TILT_LEFT));
+
+	KUNIT_EXPECT_EQ(test, g502_test_event(ctx, ctx->hdev, g502_report_idle,
+			data, sizeof(data)), 1);
+	KUNIT_EXPECT_EQ(test, ctx->gdv->btn_last, 0);
+}
+
+/* 8 byte reports of the HID++ interface aren't mouse motion */
+static void g502_test_hidpp_short_report(struct kunit *test)
+{
+	struct g502_test_ctx *ctx = test->priv;
+	u8 data[8];
+
+	KUNIT_EXPECT_EQ(test, g502_test_event(ctx, ctx->hidpp, g502_report_g6,
+			data, sizeof(data)), 1);
+	KUNIT_EXPECT_EQ(test, ctx->gdv->btn_last, 0);
+	KUNIT_EXPECT_EQ(test, g502_test_istat(ctx->gdv,
+			offsetof(struct g502_input_stats, processed)), 0);
+	flush_work(&ctx->gdv->switch_work);
+	KUNIT_EXPECT_EQ(test, ctx->gdv->active, 0);
+}
+
+/* G6 switches once per press, not once per report */
+static void g502_test_g6(struct kunit *test)
+{
+	struct g502_test_ctx *ctx = test->priv;
+	u8 data[8];
+
+	g502_test_event(ctx, ctx->hdev, g502_report_g6, data, sizeof(data));
+	KUNIT_EXPECT_EQ(test, data[1], 0);
+	g502_test_event(ctx, ctx->hdev, g502_report_g6, data, sizeof(data));
+	flush_work(&ctx->gdv->switch_work);
+	KUNIT_EXPECT_EQ(test, ctx->gdv->active, 1);
+
+	g502_test_event(ctx, ctx->hdev, g502_report_idle, data, sizeof(data));
+	g502_test_event(ctx, ctx->hdev, g502_report_g6, data, sizeof(data));
+	flush_work(&ctx->gdv->switch_work);
+	KUNIT_EXPECT_EQ(test, ctx->gdv->active, 2);
+	KUNIT_EXPECT_EQ(test, g502_test_istat(ctx->gdv,
+			offsetof(struct g502_input_stats, switches)), 2);
+}
+
+/* With only interface 0 bound, G6 still switches the profile */
+static void g502_test_g6_unbound(struct kunit *test)
+{
+	struct g502_test_ctx *ctx = test->priv;
+	u8 data[8];
+
+	ctx->gdv->cmdq.hdev = NULL;
+	g502_test_event(ctx, ctx->hdev, g502_report_g6, data, sizeof(data));
+	flush_work(&ctx->gdv->switch_work);
+	KUNIT_EXPECT_EQ(test, ctx->gdv->active, 1);
+}
+
+/* Profile 0 starts at 800 DPI, stage 1 of the defaults */
+static void g502_test_dpi_buttons(struct kunit *test)
+{
+	struct g502_test_ctx *ctx = test->priv;
+	struct logi_g502_data *gdv = ctx->gdv;
+	u8 data[8];
+	int i;
+
+	KUNIT_ASSERT_EQ(test, gdv->dpi.stage, 1);
+
+	/* Up stops at the last stage */
+	for (i = 0; i < G502_MAX_DPI_STAGES; i++) {
+		g502_test_event(ctx, ctx->hdev, g502_report_dpi_up, data, sizeof(data));
+		KUNIT_EXPECT_EQ(test, data[0], 0);
+		g502_test_event(ctx, ctx->hdev, g502_report_idle, data, sizeof(data));
+	}
+	KUNIT_EXPECT_EQ(test, gdv->dpi.stage, G502_MAX_DPI_STAGES - 1);
+
+	/* Shift moves the DPI, not the stage */
+	g502_test_event(ctx, ctx->hdev, g502_report_dpi_shift, data, sizeof(data));
+	KUNIT_EXPECT_TRUE(test, gdv->dpi.shifted);
+	g502_test_event(ctx, ctx->hdev, g502_report_idle, data, sizeof(data));
+	KUNIT_EXPECT_FALSE(test, gdv->dpi.shifted);
+
+	flush_work(&gdv->dpi_work);
+	KUNIT_EXPECT_EQ(test, gdv->profiles[0].dpi_stage, G502_MAX_DPI_STAGES - 1);
+	KUNIT_EXPECT_EQ(test, gdv->profiles[0].dev_dpi,
+			g502_default_dpi_stages[G502_MAX_DPI_STAGES - 1]);
+	KUNIT_EXPECT_EQ(test, gdv->snap.dpi, gdv->profiles[0].dev_dpi);
+}
+
+/* getReportRate answered with 1000 Hz */
+static void g502_test_reply(struct kunit *test)
+{
+	struct g502_test_ctx *ctx = test->priv;
+	struct hidpp_report request, reply;
+	struct g502_cmd *cmd;
+	u32 head;
+
+	__do_fill_report(&request, G502_COMMAND_SHORT_REPORT_ID, G502_FEATURE_REPORT_RATE,
+			G502_GET_REPORT_RATE, G502_COMMAND_SHORT_SIZE, NULL);
+	cmd = g502_test_inflight(test, ctx->gdv, &request);
+	cmd->complete = g502_report_rate_get_done;
+
+	__do_fill_report(&reply, G502_COMMAND_LONG_REPORT_ID, G502_FEATURE_REPORT_RATE,
+			cmd->report.funcindex_clientid, G502_COMMAND_LONG_SIZE, NULL);
+	reply.params_l[0] = 0x8;
+
+	head = ctx->gdv->ring->head;
+	KUNIT_EXPECT_EQ(test, g502_raw_event(ctx->hidpp, NULL, (u8 *)&reply,
+			G502_COMMAND_LONG_SIZE), 0);
+	KUNIT_EXPECT_TRUE(test, completion_done(&cmd->done));
+	KUNIT_EXPECT_EQ(test, cmd->status, 0);
+	KUNIT_EXPECT_EQ(test, cmd->response.params_l[0], 0x8);
+	KUNIT_EXPECT_EQ(test, ctx->gdv->dev_state.report_rate, 1000);
+	KUNIT_EXPECT_TRUE(test, ctx->gdv->dev_state.valid & G502_STATE_REPORT_RATE);
+	KUNIT_EXPECT_EQ(test, ctx->gdv->cmdq.nr_inflight, 0);
+	/* The reply, then its command */
+	KUNIT_EXPECT_EQ(test, ctx->gdv->ring->head, head + 2);
+	KUNIT_EXPECT_EQ(test, g502_ring_records(ctx->gdv->ring)[head %
+			G502_RING_NR_RECORDS].type, G502_REC_REPORT);
+	KUNIT_EXPECT_EQ(test, g502_ring_records(ctx->gdv->ring)[(head + 1) %
+			G502_RING_NR_RECORDS].type, G502_REC_CMD);
+
+	g502_cmd_put(cmd);
+}
+
+/* LED effects are diffed as encoded: one report per changed zone */
+static void g502_test_led_diff(struct kunit *test)
+{
+	struct g502_test_ctx *ctx = test->priv;
+	struct logi_g502_data *gdv = ctx->gdv;
+	struct g502_profile *prof = &gdv->profiles[0];
+	const struct hidpp_report *led;
+	struct g502_txn txn;
+
+	prof->dev_rgb[G_LED_PRIMARY] = 0xff8000;
+	prof->dev_rgb[G_LED_LOGO] = 0;
+	prof->dev_led[G_LED_LOGO].mode = G_LED_CYCLE;
+	prof->dev_led[G_LED_LOGO].period_ms = 5000;
+	prof->dev_led[G_LED_LOGO].brightness = 50;
+	g502_encode_profile(gdv, prof);
+	g502_state_update(gdv, G502_STATE_REPORT_RATE, prof->dev_report_rate, 0);
+	g502_state_update(gdv, G502_STATE_DPI, prof->dev_dpi, 0);
+
+	led = &prof->cmds[G502_PCMD_LED + G_LED_LOGO];
+	KUNIT_EXPECT_EQ(test, led->report_id, G502_COMMAND_LONG_REPORT_ID);
+	KUNIT_EXPECT_EQ(test, led->params_l[0], G_LED_LOGO);
+	KUNIT_EXPECT_EQ(test, led->params_l[1], G502_LED_EFFECT_CYCLE);
+	KUNIT_EXPECT_EQ(test, get_unaligned_be16(&led->params_l[7]), 5000);
+	KUNIT_EXPECT_EQ(test, led->params_l[9], 50);
+	KUNIT_EXPECT_EQ(test, led->params_l[12], G502_LED_PERSIST_RAM);
+
+	g502_txn_init(&txn, gdv, GFP_KERNEL);
+	KUNIT_EXPECT_EQ(test, g502_txn_diff_profile(&txn, prof), 0);
+	KUNIT_EXPECT_EQ(test, txn.nr_cmds, 2);
+	g502_txn_abort(&txn);
+
+	/* Both zones acked */
+	led = &prof->cmds[G502_PCMD_DPI_LED + prof->dpi_stage];
+	g502_state_update_led(gdv, G_LED_PRIMARY, &led->params_l[1], 0);
+	led = &prof->cmds[G502_PCMD_LED + G_LED_LOGO];
+	g502_state_update_led(gdv, G_LED_LOGO, &led->params_l[1], 0);
+
+	g502_txn_init(&txn, gdv, GFP_KERNEL);
+	KUNIT_EXPECT_EQ(test, g502_txn_diff_profile(&txn, prof), 0);
+	KUNIT_EXPECT_EQ(test, txn.nr_cmds, 0);
+	g502_txn_abort(&txn);
+
+	/* A primary zone without a colour is left alone */
+	prof->dev_rgb[G_LED_PRIMARY] = 0;
+	g502_encode_profile(gdv, prof);
+	KUNIT_EXPECT_EQ(test, prof->cmds[G502_PCMD_LED + G_LED_PRIMARY].report_id, 0);
+	KUNIT_EXPECT_EQ(test, prof->cmds[G502_PCMD_DPI_LED + prof->dpi_stage].report_id, 0);
+}
+
+/* Fresh values never reach the (dead) queue, stale ones do */
+static void g502_test_state_cache(struct kunit *test)
+{
+	struct g502_test_ctx *ctx = test->priv;
+	struct logi_g502_data *gdv = ctx->gdv;
+	unsigned int value = 0;
+
+	/* Before init nothing is sent, the profile's value shows */
+	KUNIT_EXPECT_EQ(test, g502_state_get(gdv, G502_STATE_DPI, &value), 0);
+	KUNIT_EXPECT_EQ(test, value, g502_active_profile(gdv)->dev_dpi);
+
+	value = 0;
+	gdv->initialized = true;
+	KUNIT_EXPECT_EQ(test, g502_state_get(gdv, G502_STATE_DPI, &value), -ENODEV);
+	KUNIT_EXPECT_EQ(test, value, 0);
+
+	g502_state_update(gdv, G502_STATE_DPI, 1600, 0);
+	KUNIT_EXPECT_EQ(test, g502_state_get(gdv, G502_STATE_DPI, &value), 0);
+	KUNIT_EXPECT_EQ(test, value, 1600);
+
+	gdv->dev_state.stamp[__ffs(G502_STATE_DPI)] -=
+			msecs_to_jiffies(G502_STATE_CACHE_MS) + 1;
+	KUNIT_EXPECT_EQ(test, g502_state_get(gdv, G502_STATE_DPI, &value), -ENODEV);
+}
+
+/* HID++ 2.0 errors mirror the short request behind feature index 0xff */
+static void g502_test_error_reply(struct kunit *test)
+{
+	struct g502_test_ctx *ctx = test->priv;
+	struct hidpp_report request, reply;
+	struct g502_cmd *cmd;
+
+	__do_fill_report(&request, G502_COMMAND_SHORT_REPORT_ID, G502_FEATURE_DPI,
+			G502_SET_DPI, G502_COMMAND_SHORT_SIZE, NULL);
+	cmd = g502_test_inflight(test, ctx->gdv, &request);
+
+	__do_fill_report(&reply, G502_COMMAND_SHORT_REPORT_ID, G502_FEATURE_ERROR,
+			0, G502_COMMAND_SHORT_SIZE, NULL);
+	reply.params_s[0] = G502_FEATURE_DPI;
+	reply.params_s[1] = cmd->report.funcindex_clientid;
+	reply.params_s[2] = 0x02; /* Invalid argument */
+
+	KUNIT_EXPECT_EQ(test, g502_raw_event(ctx->hidpp, NULL, (u8 *)&reply,
+			G502_COMMAND_SHORT_SIZE), 0);
+	KUNIT_EXPECT_TRUE(test, completion_done(&cmd->done));
+	KUNIT_EXPECT_EQ(test, cmd->status, -EINVAL);
+	KUNIT_EXPECT_EQ(test, cmd->hidpp_err, G502_HIDPP_ERR_INVALID_ARGUMENT);
+	KUNIT_EXPECT_EQ(test, ctx->gdv->cmdq.health.hidpp[G502_HIDPP_ERR_INVALID_ARGUMENT], 1);
+
+	g502_cmd_put(cmd);
+}
+
+/* Busy is transient, but a stopped queue never resends. Unknown codes
+ * are accounted as "other". */
+static void g502_test_busy_reply(struct kunit *test)
+{
+	struct g502_test_ctx *ctx = test->priv;
+	struct g502_cmdq_health *health = &ctx->gdv->cmdq.health;
+	struct hidpp_report request, reply;
+	struct g502_cmd *cmd;
+
+	__do_fill_report(&request, G502_COMMAND_SHORT_REPORT_ID, G502_FEATURE_DPI,
+			G502_SET_DPI, G502_COMMAND_SHORT_SIZE, NULL);
+	cmd = g502_test_inflight(test, ctx->gdv, &request);
+
+	__do_fill_report(&reply, G502_COMMAND_SHORT_REPORT_ID, G502_FEATURE_ERROR,
+			0, G502_COMMAND_SHORT_SIZE, NULL);
+	reply.params_s[0] = G502_FEATURE_DPI;
+	reply.params_s[1] = cmd->report.funcindex_clientid;
+	reply.params_s[2] = G502_HIDPP_ERR_BUSY;
+
+	KUNIT_EXPECT_EQ(test, g502_raw_event(ctx->hidpp, NULL, (u8 *)&reply,
+			G502_COMMAND_SHORT_SIZE), 0);
+	KUNIT_EXPECT_TRUE(test, completion_done(&cmd->done));
+	KUNIT_EXPECT_EQ(test, cmd->status, -EBUSY);
+	KUNIT_EXPECT_EQ(test, health->hidpp[G502_HIDPP_ERR_BUSY], 1);
+	KUNIT_EXPECT_EQ(test, health->retried, 0);
+	g502_cmd_put(cmd);
+
+	cmd = g502_test_inflight(test, ctx->gdv, &request);
+	reply.params_s[1] = cmd->report.funcindex_clientid;
+	reply.params_s[2] = 0x42;
+	KUNIT_EXPECT_EQ(test, g502_raw_event(ctx->hidpp, NULL, (u8 *)&reply,
+			G502_COMMAND_SHORT_SIZE), 0);
+	KUNIT_EXPECT_EQ(test, cmd->status, -EIO);
+	KUNIT_EXPECT_EQ(test, health->hidpp[0], 1);
+	g502_cmd_put(cmd);
+}
+
+static struct g502_macro_prog *g502_test_macro(struct kunit *test, u16 code)
+{
+	struct g502_macro m = {
+		.nr_steps = 1,
+		.steps[0] = { G502_MACRO_KEY_DOWN, 0, code, G502_MACRO_MAX_DELAY_US },
+	};
+	struct g502_macro_prog *prog = g502_macro_compile(&m);
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, prog);
+	return prog;
+}
+
+/* Replacing the macro that plays ends it, the queue goes on with the
+ * new version of it */
+static void g502_test_macro_replace(struct kunit *test)
+{
+	struct g502_test_ctx *ctx = test->priv;
+	struct logi_g502_data *gdv = ctx->gdv;
+	struct g502_macro_prog *prog;
+	unsigned long flags;
+
+	gdv->macros[0] = g502_test_macro(test, KEY_A);
+	gdv->macros[1] = g502_test_macro(test, KEY_B);
+	g502_macro_trigger(gdv, 0);
+	g502_macro_trigger(gdv, 0);
+	g502_macro_trigger(gdv, 1);
+	prog = g502_test_macro(test, KEY_C);
+
+	spin_lock_irqsave(&gdv->macro_lock, flags);
+	swap(gdv->macros[0], prog);
+	__g502_macro_skip(gdv);
+	KUNIT_EXPECT_PTR_EQ(test, gdv->macro_prog, gdv->macros[0]);
+	KUNIT_EXPECT_EQ(test, gdv->macro_qcount, 1);
+	spin_unlock_irqrestore(&gdv->macro_lock, flags);
+
+	g502_macro_stop(gdv);
+	kfree(prog);
+}
+
+static bool g502_test_txn_has(const struct g502_txn *txn, u8 feature_index)
+{
+	unsigned int i;
+
+	for (i = 0; i < txn->nr_cmds; i++)
+		if (txn->cmds[i]->report.feature_index == feature_index)
+			return true;
+	return false;
+}
+
+/* A config push while shift is held leaves the shift DPI alone */
+static void g502_test_dpi_shift_diff(struct kunit *test)
+{
+	struct g502_test_ctx *ctx = test->priv;
+	struct logi_g502_data *gdv = ctx->gdv;
+	struct g502_profile *prof = &gdv->profiles[0];
+	struct g502_txn txn;
+
+	g502_state_update(gdv, G502_STATE_DPI, G502_DPI_SHIFT_DEFAULT, 0);
+	gdv->dpi.shifted = true;
+	g502_txn_init(&txn, gdv, GFP_KERNEL);
+	KUNIT_EXPECT_EQ(test, g502_txn_diff_profile(&txn, prof), 0);
+	KUNIT_EXPECT_FALSE(test, g502_test_txn_has(&txn, gdv->features[G502_F_DPI]));
+	g502_txn_abort(&txn);
+
+	gdv->dpi.shifted = false;
+	g502_txn_init(&txn, gdv, GFP_KERNEL);
+	KUNIT_EXPECT_EQ(test, g502_txn_diff_profile(&txn, prof), 0);
+	KUNIT_EXPECT_TRUE(test, g502_test_txn_has(&txn, gdv->features[G502_F_DPI]));
+	g502_txn_abort(&txn);
+}
+
+/* Nothing in flight: dropped, and nothing else touched */
+static void g502_test_stale_reply(struct kunit *test)
+{
+	struct g502_test_ctx *ctx = test->priv;
+	struct hidpp_report reply;
+
+	__do_fill_report(&reply, G502_COMMAND_LONG_REPORT_ID, G502_FEATURE_REPORT_RATE,
+			G502_GET_REPORT_RATE | LINUX_KERNEL_SW_ID, G502_COMMAND_LONG_SIZE, NULL);
+	reply.params_l[0] = 0x1;
+
+	KUNIT_EXPECT_EQ(test, g502_raw_event(ctx->hidpp, NULL, (u8 *)&reply,
+			G502_COMMAND_LONG_SIZE), 1);
+	KUNIT_EXPECT_FALSE(test, ctx->gdv->dev_state.valid & G502_STATE_REPORT_RATE);
+
+	/* Sizes that are neither are not HID++ */
+	KUNIT_EXPECT_EQ(test, g502_raw_event(ctx->hidpp, NULL, (u8 *)&reply, 12), 1);
+}
+
+/* ns per motion report through raw_event, the path every report takes */
+static void g502_test_bench_fast_path(struct kunit *test)
+{
+	struct g502_test_ctx *ctx = test->priv;
+	u8 data[8];
+	u64 start, ns;
+	int i;
+
+	start = ktime_get_ns();
+	for (i = 0; i < G502_TEST_BENCH_EVENTS; i++) {
+		memcpy(data, g502_report_motion, sizeof(data));
+		g502_raw_event(ctx->hdev, NULL, data, sizeof(data));
+		g502_input_account_sync(ctx->gdv);
+	}
+	ns = ktime_get_ns() - start;
+
+	kunit_info(test, "fast path: %llu ns/event over %d events\n",
+			div_u64(ns, G502_TEST_BENCH_EVENTS), G502_TEST_BENCH_EVENTS);
+	KUNIT_EXPECT_EQ(test, g502_test_istat(ctx->gdv,
+			offsetof(struct g502_input_stats, processed)), G502_TEST_BENCH_EVENTS);
+}
+
+static struct kunit_case g502_test_cases[] = {
+	KUNIT_CASE(g502_test_fill_report),
+	KUNIT_CASE(g502_test_report_rates),
+	KUNIT_CASE(g502_test_rdesc_fixup),
+	KUNIT_CASE(g502_test_motion),
+	KUNIT_CASE(g502_test_tilt),
+	KUNIT_CASE(g502_test_g6),
+	KUNIT_CASE(g502_test_hidpp_short_report),
+	KUNIT_CASE(g502_test_g6_unbound),
+	KUNIT_CASE(g502_test_dpi_buttons),
+	KUNIT_CASE(g502_test_reply),
+	KUNIT_CASE(g502_test_error_reply),
+	KUNIT_CASE(g502_test_busy_reply),
+	KUNIT_CASE(g502_test_state_cache),
+	KUNIT_CASE(g502_test_led_diff),
+	KUNIT_CASE(g502_test_stale_reply),
+	KUNIT_CASE(g502_test_dpi_shift_diff),
+	KUNIT_CASE(g502_test_macro_replace),
+	KUNIT_CASE(g502_test_bench_fast_path),
+	{}
+};
+
+static struct kunit_suite g502_test_suite = {
+	.name = "g502",
+	.init = g502_test_init,
+	.exit = g502_test_exit,
+	.test_cases = g502_test_cases,
+};
+kunit_test_suite(g502_test_suite);
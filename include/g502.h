@@ -19,19 +19,31 @@ static inline RGB rgb_to_struct_rgb(unsigned int hrgb)
     return rgbcolor;
 }
 
+/* Report rates the device takes, in Hz, and their vendor defined
+ * encoding in the hidpp_report params. */
+struct g502_rate_code {
+    u16 hz;
+    u8 code;
+};
+
+static const struct g502_rate_code g502_report_rates[] = {
+    { 125U,     0x1U },
+    { 250U,     0x2U },
+    { 500U,     0x4U },
+    { 1000U,    0x8U },
+};
+
 /* This functions matches a vendor defined report rate hex
  * values to human-readable values, to be used with sysfs.
 */
 static __always_inline unsigned int report_rate_htd(const u8 report_rate)
 {
-    switch (report_rate)
-    {
-    case 0x1U:      return 125U;
-    case 0x2U:      return 250U;
-    case 0x4U:      return 500U;
-    case 0x8U:      return 1000U;
-    default:        return 0U;
-    }
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(g502_report_rates); i++)
+        if (g502_report_rates[i].code == report_rate)
+            return g502_report_rates[i].hz;
+    return 0U;
 }
 
 /* This functions matches the vendor defined hex values that
@@ -40,22 +52,13 @@ static __always_inline unsigned int report_rate_htd(const u8 report_rate)
 */
 static __always_inline u8 report_rate_dth(unsigned int report_rate)
 {
-    switch (report_rate)
-    {
-    case 125U:    return 0x1U;
-    case 250U:    return 0x2U;
-    case 500U:    return 0x4U;
-    case 1000U:   return 0x8U;
-    default:      return 0U;
-    }
-}
+    unsigned int i;
 
-/* @list_next_entry_circular was only added in v5.19 */
-#ifndef list_next_entry_circular
-#define list_next_entry_circular(pos, head, member) \
-	(list_is_last(&(pos)->member, head) ? \
-	list_first_entry(head, typeof(*(pos)), member) : list_next_entry(pos, member))
-#endif
+    for (i = 0; i < ARRAY_SIZE(g502_report_rates); i++)
+        if (g502_report_rates[i].hz == report_rate)
+            return g502_report_rates[i].code;
+    return 0U;
+}
 
 /* struct usb_device */
 #define	hid_to_usb_dev(hid_dev)                              \
@@ -63,10 +66,19 @@ static __always_inline u8 report_rate_dth(unsigned int report_rate)
 
 #define LOGITECH_VENDOR_ID          0x046d
 #define G502_HERO_DEVICE_ID         0xc08b
-#define LINUX_KERNEL_SW_ID			0x1
+#define G502_SPECTRUM_DEVICE_ID     0xc332
+#define G403_DEVICE_ID              0xc083
+#define G403_HERO_DEVICE_ID         0xc08f
+#define G_PRO_DEVICE_ID             0xc085
+#define G_PRO_HERO_DEVICE_ID        0xc08c
+#define G203_DEVICE_ID              0xc084
 
-/* Quirk. should be checked against firmware version */
-#define G502_ON_BOARD_MEM_5_PROF_QUIRK          0x400
+/* The low nibble of @funcindex_clientid is the software ID, echoed back
+ * by the device in its reply. Zero is reserved for device notifications,
+ * so we rotate through 1..15 for the commands we have in flight. */
+#define LINUX_KERNEL_SW_ID			0x1
+#define G502_SW_ID_MASK             0x0fU
+#define G502_FUNCTION_MASK          0xf0U
 
 /* Generic informiaton */
 #define G502_MAX_RESOLUTION_DPI                 25600
@@ -83,12 +95,54 @@ static __always_inline u8 report_rate_dth(unsigned int report_rate)
 
 #define G502_DEVICE_INDEX_RECEIVER              0xffU
 
-/* In the future use those to get feature as according to doc */
+/* HID++ 2.0 error replies carry this feature index, followed by the
+ * original feature index, function/sw id and the error code. */
+#define G502_FEATURE_ERROR                      0xffU
+
+/* HID++ 2.0 error codes, see g502_hidpp_errors */
+#define G502_HIDPP_ERR_UNKNOWN                  0x01U
+#define G502_HIDPP_ERR_INVALID_ARGUMENT         0x02U
+#define G502_HIDPP_ERR_OUT_OF_RANGE             0x03U
+#define G502_HIDPP_ERR_HW_ERROR                 0x04U
+#define G502_HIDPP_ERR_INTERNAL                 0x05U
+#define G502_HIDPP_ERR_INVALID_FEATURE_INDEX    0x06U
+#define G502_HIDPP_ERR_INVALID_FUNCTION_ID      0x07U
+#define G502_HIDPP_ERR_BUSY                     0x08U
+#define G502_HIDPP_ERR_UNSUPPORTED              0x09U
+#define G502_HIDPP_ERR_NR                       0x0aU /* 0 takes anything unknown */
+
+/* Command queue limits */
+#define G502_CMD_MAX_INFLIGHT                   4
+#define G502_CMD_TIMEOUT_MS                     500
+#define G502_TXN_MAX_CMDS                       8
+
+/* Transient failures (busy, timeouts, dropped transfers) are resent after
+ * G502_CMD_RETRY_BASE_MS, doubling up to G502_CMD_RETRY_MAX_MS, at most
+ * G502_CMD_MAX_RETRIES times. A config push that still fails is redone
+ * from scratch the same way, starting at G502_CONFIG_RETRY_MS. */
+#define G502_CMD_MAX_RETRIES                    3
+#define G502_CMD_RETRY_BASE_MS                  20
+#define G502_CMD_RETRY_MAX_MS                   200
+#define G502_CONFIG_MAX_RETRIES                 5
+#define G502_CONFIG_RETRY_MS                    1000
+
+/* IRoot is always at index 0, getFeature(feature ID) returns the
+ * index, type and version of that feature on this device. */
 #define HIDPP_PAGE_ROOT_IDX                     0x00U
 #define CMD_ROOT_GET_FEATURE                    0x00U
 
+/* HID++ 2.0 feature IDs of what we use, resolved at probe */
+#define HIDPP_FEATURE_ROOT                      0x0000U
+#define HIDPP_FEATURE_DEVICE_FW                 0x0003U
+#define HIDPP_FEATURE_ADJUSTABLE_DPI            0x2201U
+#define HIDPP_FEATURE_REPORT_RATE               0x8060U
+#define HIDPP_FEATURE_COLOR_LED_EFFECTS         0x8070U
+#define HIDPP_FEATURE_ONBOARD_PROFILES          0x8100U
+
 /* Features index and their functions
- * Note: These are device specific (Only index).
+ * Note: These are device specific (Only index). We discover the real
+ * ones through IRoot, these stay as the G502 Hero's defaults in case
+ * discovery fails.
  * FIXME: Too long names and it bothers me, shorten them.
 */
 #define G502_FEATURE_REPORT_RATE            0x0bU /* 0x8060 */
@@ -98,7 +152,7 @@ static __always_inline u8 report_rate_dth(unsigned int report_rate)
 #define G502_MAX_DPI_VALUE           25600U
 #define G502_FEATURE_DPI             0x0aU /* 0x2201 */
 #   define G502_GET_DPI              0x20U
-#   define G502_SET_DPI              0x03U
+#   define G502_SET_DPI              0x30U
 
 /* Currently we don't support mutltiple profiles,
  * so we disable it on device's probe. On/Off should be
@@ -107,6 +161,32 @@ static __always_inline u8 report_rate_dth(unsigned int report_rate)
 #   define G502_CONTROL_ON_BOARD_PROFILES    0x10U
 #   define G502_ON_BOARD_PROFILES_ON         0x01U
 #   define G502_ON_BOARD_PROFILES_OFF        0x02U
+#   define G502_GET_ON_BOARD_INFO            0x00U
+#   define G502_SET_CURRENT_PROFILE          0x30U /* params: 0, index + 1 */
+#   define G502_MEMORY_READ                  0x50U /* params: sector, offset */
+#   define G502_MEMORY_ADDR_WRITE            0x60U /* params: sector, offset, length */
+#   define G502_MEMORY_WRITE                 0x70U /* params: G502_ONBOARD_CHUNK bytes */
+#   define G502_MEMORY_WRITE_END             0x80U
+
+/* On-board profile memory, optional (see the onboard_profiles parameter).
+ * Memory is read and written in 16 byte chunks through LONG reports, it
+ * is organized in sectors of a device specific size ending with a
+ * big-endian CRC-CCITT (0xffff seed). Sector 0 is the profile directory,
+ * profile N lives in sector N + 1 and its factory copy in ROM. */
+#define G502_ONBOARD_CHUNK                  16
+#define G502_ONBOARD_DIR_SECTOR             0x0000U
+#define G502_ONBOARD_ROM_SECTOR             0x0100U
+#define G502_ONBOARD_MAX_SECTOR_SIZE        1024
+#define G502_ONBOARD_FORMAT_MIN             1
+#define G502_ONBOARD_FORMAT_MAX             3
+
+/* Profile sector layout of the formats above, only what we fill in */
+#define G502_OBP_REPORT_RATE                0   /* 1000 / Hz */
+#define G502_OBP_DEFAULT_DPI                1   /* Index in G502_OBP_DPI */
+#define G502_OBP_DPI                        3   /* 5 x le16 */
+#define G502_OBP_LEDS                       208 /* 2 x G502_OBP_LED_SIZE */
+#define G502_OBP_LED_SIZE                   11
+#define G502_OBP_MIN_SECTOR_SIZE            (G502_OBP_LEDS + G502_MAX_LED_ZONES * G502_OBP_LED_SIZE + 2)
 
 /* Control led modes, e.g.
  * 0x02 (feature index)
@@ -116,13 +196,84 @@ static __always_inline u8 report_rate_dth(unsigned int report_rate)
 */
 #define G502_FEATURE_COLOR_LED_EFFECTS            0x02U /* 0x8070 */
 #   define G502_CHANGE_LED_MODE                         0x30U
+#   define G502_LED_EFFECT_OFF                          0x00U
+#   define G502_LED_EFFECT_FIXED                        0x01U /* RGB */
+#   define G502_LED_EFFECT_CYCLE                        0x03U /* 5 x 0, period (be16), brightness */
+#   define G502_LED_EFFECT_BREATHING                    0x0aU /* RGB, period (be16), waveform, brightness */
+#   define G502_LED_EFFECT_SIZE                         11    /* params[1..11], the effect first */
+#   define G502_LED_PERSIST_RAM                         0x01U /* params[12] */
+#define G502_MAX_LED_ZONES                        2
+
+/* @period_ms of the breathing and cycle effects, from
+ * G502_LED_PERIOD_MIN_MS to G502_LED_PERIOD_MAX_MS (uapi) */
+#define G502_LED_PERIOD_DEFAULT_MS  10000
 
 
-/* Firmware information. Firmware entity should be passed after
- * the function index, as a parameter.. We always pass 1. LMK for issues.
+/* Firmware information. The entity count comes first in the reply of
+ * G502_GET_FW_COUNT. For G502_GET_FW_INFO the firmware entity index is
+ * passed as the first parameter, the reply is type, 3 char name, version
+ * and revision (BCD) then the build (be16, BCD).
 */
 #define G502_FEATURE_DEVICE_FW                    0x03U /* 0x0003 */
+#   define G502_GET_FW_COUNT                            0x00U
 #   define G502_GET_FW_INFO                             0x10U
+#define G502_FW_MAX_ENTITIES                      4
+
+/* The driver's own names for the HID++ features it uses,
+ * independent of the device specific index. */
+enum g502_feature {
+    G502_F_ROOT,
+    G502_F_DEVICE_FW,
+    G502_F_DPI,
+    G502_F_REPORT_RATE,
+    G502_F_COLOR_LED,
+    G502_F_ON_BOARD_PROFILES,
+    G502_F_NR
+};
+
+/* A mouse interface descriptor we replace, recognized by size and crc32 */
+struct g502_rdesc_fixup {
+    unsigned int size;
+    u32 crc;
+    const u8 *rdesc;
+    unsigned int rsize;
+};
+
+/* Wired mice we drive, indexes into g502_models */
+enum g502_model_id {
+    G502_MODEL_G502_HERO,
+    G502_MODEL_G502_SPECTRUM,
+    G502_MODEL_G403,
+    G502_MODEL_G403_HERO,
+    G502_MODEL_G_PRO,
+    G502_MODEL_G_PRO_HERO,
+    G502_MODEL_G203,
+    G502_MODEL_NR
+};
+
+/* The G502 body: tilt wheel and G6 are reported in the second byte */
+#define G502_MODEL_EXTRA_BUTTONS    BIT(0)
+/* On-board memory has our 5 profile layout, the G203's holds a single one */
+#define G502_MODEL_ONBOARD_5_PROF   BIT(1)
+#define G502_BUTTON_BIT_DPI_SHIFT   5
+#define G502_BUTTON_BIT_DPI_DOWN    6
+#define G502_BUTTON_BIT_DPI_UP      7
+#define G502_BUTTON_BIT_G6          8
+#define G502_BUTTON_BIT_TILT_LEFT   9
+#define G502_BUTTON_BIT_TILT_RIGHT  10
+
+/* What differs between the mice sharing this driver.
+ * @rate_mask is a mask of the supported g502_report_rates codes.
+ * @features are the fallback indexes if discovery fails, 0 (missing)
+ * for everything but IRoot unless we know the model's layout. */
+struct g502_model {
+    const char *name;
+    u16 max_dpi;
+    u8 rate_mask;
+    u8 nr_led_zones;
+    unsigned long flags;
+    u8 features[G502_F_NR];
+};
 
 enum firmware_type {
     FW_MAIN_APP         = 0,
@@ -145,6 +296,15 @@ enum g502_led_mode {
 	G_LED_CYCLE
 };
 
+/* One LED zone of a profile, its colour is kept apart in @dev_rgb.
+ * @brightness is in %, 0 for full. A fixed colour has no brightness on
+ * the device side, it's scaled instead. */
+struct g502_led_cfg {
+    u8 mode; /* enum g502_led_mode */
+    u8 brightness;
+    u16 period_ms; /* Breathing and cycle, 0 for G502_LED_PERIOD_DEFAULT_MS */
+};
+
 /* We are able to set a different LED configuration for each LED of our device.
  * TODO: Implement a sync option that will set the same config for both LEDs.
 */
@@ -153,12 +313,65 @@ enum g502_led_type {
 	G_LED_LOGO    /* Logitech Icon */
 };
 
-struct g502_profile {
-	struct list_head entry;
-	unsigned int dev_rgb;
-    u16 dev_report_rate;
-	u16 dev_dpi;
-	int index;
+/* sysfs writes are coalesced and sent at most this often */
+#define G502_CONFIG_FLUSH_MS        100
+
+/* Adaptive report rate. The shortest idle timeout bounds how often the
+ * rate can flip, and motion under G502_IDLE_WAKE_COUNTS (sensor noise)
+ * neither counts as activity nor wakes the mouse up. */
+#define G502_IDLE_MIN_TIMEOUT_MS    1000
+#define G502_IDLE_RATE_DEFAULT      125
+#define G502_IDLE_WAKE_COUNTS       2
+
+/* Software LED effects (Screen Sampler, Audio Visualizer and the like).
+ * Frames are queued by userspace and sent by an hrtimer, at most
+ * G502_LED_MAX_FPS of them a second. @rgb is indexed by g502_led_type. */
+#define G502_LED_MAX_FPS            30
+#define G502_LED_RING_SIZE          8
+
+struct g502_led_frame {
+    unsigned int rgb[G502_MAX_LED_ZONES];
+};
+
+/* @merged counts frames skipped over because the previous one was still
+ * in flight, @dropped the ones that didn't fit in the ring. */
+struct g502_led_stats {
+    u64 frames;
+    u64 sent;
+    u64 merged;
+    u64 dropped;
+};
+
+/* What the device last acknowledged. A field only counts
+ * if its G502_STATE_* bit is set in @valid. */
+#define G502_STATE_REPORT_RATE      BIT(0)
+#define G502_STATE_DPI              BIT(1)
+#define G502_STATE_RGB(zone)        BIT(2 + (zone)) /* The zone's whole effect */
+#define G502_STATE_RGB_ALL          GENMASK(2 + G502_MAX_LED_ZONES - 1, 2)
+#define G502_STATE_NR_FIELDS        (2 + G502_MAX_LED_ZONES)
+
+/* Reads of the confirmed state (sysfs) trust a field for this long,
+ * after that they ask the device, waiting at most G502_STATE_GET_TIMEOUT_MS. */
+#define G502_STATE_CACHE_MS         1000
+#define G502_STATE_GET_TIMEOUT_MS   1000
+
+/* @stamp is in jiffies, by G502_STATE_* bit number. @led is what each
+ * zone was set to, as in setZoneEffect (G502_LED_EFFECT_SIZE bytes). */
+struct g502_dev_state {
+    u16 report_rate;
+    u16 dpi;
+    u8 led[G502_MAX_LED_ZONES][G502_LED_EFFECT_SIZE];
+    unsigned long valid;
+    unsigned long stamp[G502_STATE_NR_FIELDS];
+};
+
+/* Copy of the active profile, published for readers that must not
+ * block (raw_event) or shouldn't wait on the config path (sysfs). */
+struct g502_snapshot {
+    int index;
+    u16 report_rate;
+    u16 dpi;
+    unsigned int rgb[G502_MAX_LED_ZONES];
 };
 
 /* FIXME:
@@ -178,11 +391,233 @@ struct hidpp_report {
     };
 } __packed;
 
-/* This struct defines a firmware to be used with quirks */
+#define G502_MAX_DPI_STAGES         5
+#define G502_DPI_SHIFT_DEFAULT      400
+
+/* The SETs a profile is made of, see g502_encode_profile(). The DPI
+ * buttons send the ones after @G502_PCMD_LED as they are. */
+enum g502_profile_cmd {
+    G502_PCMD_REPORT_RATE,
+    G502_PCMD_DPI,
+    G502_PCMD_LED, /* One per LED zone, indexed by enum g502_led_type, report_id 0 if unset */
+    G502_PCMD_DPI_STAGE = G502_PCMD_LED + G502_MAX_LED_ZONES, /* One per stage */
+    G502_PCMD_DPI_SHIFT = G502_PCMD_DPI_STAGE + G502_MAX_DPI_STAGES,
+    G502_PCMD_DPI_LED, /* G_LED_PRIMARY showing each stage, report_id 0 if unset */
+    G502_PCMD_NR = G502_PCMD_DPI_LED + G502_MAX_DPI_STAGES
+};
+
+/* What the DPI buttons work on, copied from the active profile when it is
+ * published so the event path never waits on @mutex_dev. @stage is where
+ * the buttons left it, @shifted is set while the shift button is held. */
+struct g502_dpi_state {
+    int index; /* Of the profile @cmds are from */
+    u8 nr_stages;
+    u8 stage;
+    bool shifted;
+    struct hidpp_report cmds[G502_PCMD_NR - G502_PCMD_DPI_STAGE];
+};
+
+#define g502_dpi_cmd(dpi, pcmd)     (&(dpi)->cmds[(pcmd) - G502_PCMD_DPI_STAGE])
+
+/* Macro bytecode, one u32 per op: action (enum g502_macro_action) in
+ * bits 31-30, key in 29-20 and the delay after it in 19-0, in us.
+ * Longer delays are split over WAIT ops. */
+#define G502_MOP(action, code, delay) \
+    (((u32)(action) << 30) | ((u32)(code) << 20) | (u32)(delay))
+#define G502_MOP_ACTION(op)         ((op) >> 30)
+#define G502_MOP_CODE(op)           (((op) >> 20) & 0x3ffU)
+#define G502_MOP_DELAY(op)          ((op) & 0xfffffU)
+#define G502_MOP_MAX_DELAY          0xfffffU
+#define G502_MACRO_QUEUE_LEN        4
+
+struct g502_macro_prog {
+    unsigned int nr_ops;
+    u32 ops[];
+};
+
+struct g502_macro_stats {
+    u64 played;
+    u64 queued;
+    u64 dropped;
+    u64 late_max_ns; /* Worst timer lateness seen */
+};
+
+/* Keys a remapped button or a macro may send. Clients only read the capabilities
+ * once, so g502_input_configured() declares all of these up front.
+ * Keyboard keys and mouse buttons only, nothing that makes udev take
+ * the mouse for a joystick or a tablet. */
+static inline bool g502_key_remappable(unsigned int code)
+{
+    return (code >= KEY_ESC && code <= KEY_MICMUTE) ||
+        (code >= BTN_LEFT && code <= BTN_TASK);
+}
+
+/* A profile's buttons, indexed by button bit. Bits in @remapped are
+ * handled by the driver and cleared before hid-core sees the report.
+ * Never changed once published, replaced and freed after a grace period. */
+struct g502_button_map {
+    u16 remapped;
+    struct g502_button act[G502_NR_BUTTONS];
+    struct rcu_head rcu;
+};
+
+/* @dev_report_rate is in Hz, it's encoded with report_rate_dth() when sent.
+ * @dev_rgb is 0xRRGGBB per LED zone, shown as @dev_led says. A fixed or
+ * breathing zone without a colour is left alone.
+ * @dev_dpi is what's sent, @dpi_stages[@dpi_stage] once stages are set.
+ * @shift_dpi is used while the DPI shift button is held, 0 for none.
+ * A field that is 0 is left as the device has it.
+ * @cmds are the ready to send SETs for the fields above, rebuilt whenever
+ * the profile is edited or the feature indexes change. */
+struct g502_profile {
+	unsigned int dev_rgb[G502_MAX_LED_ZONES];
+	struct g502_led_cfg dev_led[G502_MAX_LED_ZONES];
+    u16 dev_report_rate;
+	u16 dev_dpi;
+	u16 dpi_stages[G502_MAX_DPI_STAGES];
+	u8 nr_dpi_stages;
+	u8 dpi_stage;
+	u16 shift_dpi;
+	int index;
+	struct g502_button_map *buttons;
+	struct hidpp_report cmds[G502_PCMD_NR];
+};
+
+/* The whole mmap()able event ring, see uapi/g502.h */
+#define G502_RING_SIZE \
+    PAGE_ALIGN(G502_RING_DATA_OFFSET + \
+        G502_RING_NR_RECORDS * sizeof(struct g502_ring_record))
+
+static inline struct g502_ring_record *g502_ring_records(struct g502_ring_header *ring)
+{
+    return (struct g502_ring_record *)((u8 *)ring + G502_RING_DATA_OFFSET);
+}
+
+struct g502_cmd;
+struct logi_g502_data;
+typedef void (*g502_cmd_done_t)(struct g502_cmd *cmd);
+
+/* Round-trip time of one feature's commands, from submit to reply.
+ * @buckets[i] counts replies within [2^i, 2^(i+1)) us, the last one
+ * everything slower. The first one also takes anything under 1 us. */
+#define G502_LAT_BUCKETS                16
+
+struct g502_lat_stats {
+    u64 buckets[G502_LAT_BUCKETS];
+    u64 replies;
+    u64 total_us;
+    u64 max_us;
+    u64 timeouts;
+    u64 errors;
+};
+
+/* Per-CPU counters for the 8-byte mouse report path. @sync_buckets[i]
+ * counts reports that took [2^i, 2^(i+1)) ns from raw_event to input_sync.
+ * @stamp is the raw_event entry time of the report being handled. */
+#define G502_INPUT_LAT_BUCKETS          24
+
+struct g502_input_stats {
+    u64 processed;
+    u64 passed;
+    u64 switches;
+    u64 sync_buckets[G502_INPUT_LAT_BUCKETS];
+    u64 stamp;
+};
+
+/* A single HID++ request travelling through the command queue.
+ * @report is sent as is, except for the software ID which is assigned
+ * when the command goes out. @response holds the matching reply.
+ * @complete (optional) runs from the reply context and must not sleep.
+*/
+struct g502_cmd {
+    struct list_head entry;
+    struct kref ref;
+    struct completion done;
+    struct hidpp_report report;
+    struct hidpp_report response;
+    g502_cmd_done_t complete;
+    void *context;
+    ktime_t submitted;
+    unsigned long deadline;
+    int status;
+    bool replied;
+    bool low_prio; /* Only sent when nothing else is pending, never resent */
+    u8 sw_id;
+    u8 hidpp_err; /* Of an error reply, by G502_HIDPP_ERR_* */
+    u8 retries; /* Resends so far */
+    unsigned long retry_at; /* jiffies, while on the queue's @retry */
+};
+
+/* Why commands failed, for debugfs. @hidpp is by HID++ error code,
+ * @send_errors counts transfers the USB side didn't take, @recovered
+ * commands that made it on a resend and @exhausted the ones that ran
+ * out of them. */
+struct g502_cmdq_health {
+    u64 hidpp[G502_HIDPP_ERR_NR];
+    u64 timeouts;
+    u64 send_errors;
+    u64 retried;
+    u64 recovered;
+    u64 exhausted;
+};
+
+/* Per-device command pipeline. Commands are queued on @pending,
+ * sent from @send_work and then wait on @inflight for their reply,
+ * which is matched by (feature index, function index, software ID).
+ * @pending_low (LED frames) only goes out when @pending is empty, and
+ * never takes the last free slot so config commands don't wait on it.
+ * Commands failing transiently wait out their backoff on @retry, then
+ * go back to the head of @pending.
+*/
+struct g502_cmdq {
+    spinlock_t lock; /* Protects the lists and the counters below */
+    struct list_head pending;
+    struct list_head pending_low;
+    struct list_head inflight;
+    unsigned int nr_inflight;
+    u16 swid_busy;
+    u8 next_swid;
+    bool dead;
+    struct work_struct send_work;
+    struct delayed_work timeout_work;
+    struct list_head retry;
+    struct delayed_work retry_work;
+    unsigned long retry_next; /* When @retry_work is due, if pending */
+    struct g502_cmdq_health health;
+    struct hid_device *hdev; /* Interface 1, NULL while it is unbound */
+    const u8 *features; /* Feature table of the owner, see g502_feature_from_index() */
+    struct g502_lat_stats stats[G502_F_NR + 1]; /* Last one for unknown features */
+};
+
+/* One firmware entity of the device, as getFwInfo reports it */
 struct gfirmware {
     enum firmware_type ftype;
-    unsigned nr_entities;
-    char *fwversion;
+    char name[4];
+    u8 version;
+    u8 revision;
+    u16 build;
+    bool valid;
+};
+
+/* Resolved feature indexes and firmware info, shared by every device with
+ * the same product ID and firmware (bcdDevice), so a replug skips discovery. */
+struct g502_feature_cache {
+    struct list_head entry;
+    u16 product;
+    u16 bcd_device;
+    u8 features[G502_F_NR];
+    struct gfirmware gfw[G502_FW_MAX_ENTITIES];
+};
+
+/* A batch of commands that is submitted at once, so they are all in
+ * flight together, and then waited on as a whole. */
+struct g502_txn {
+    struct logi_g502_data *gdv;
+    struct g502_cmd *cmds[G502_TXN_MAX_CMDS];
+    unsigned int nr_cmds;
+    unsigned int nr_sent; /* Taken by the queue in the last g502_txn_commit_nowait() */
+    gfp_t gfp;
+    bool low_prio;
 };
 
 static void g502_hero_remove(struct hid_device *hdev);
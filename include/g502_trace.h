@@ -0,0 +1,136 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM g502
+
+#if !defined(G502_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define G502_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* @dev_id is hid_device->id, the last part of the HID device name,
+ * e.g. 0003:046D:C08B.0005 is 5. */
+
+TRACE_EVENT(g502_cmd_submit,
+	TP_PROTO(unsigned int dev_id, u8 feature, u8 function),
+	TP_ARGS(dev_id, feature, function),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, dev_id)
+		__field(u8, feature)
+		__field(u8, function)
+	),
+
+	TP_fast_assign(
+		__entry->dev_id = dev_id;
+		__entry->feature = feature;
+		__entry->function = function;
+	),
+
+	TP_printk("dev=%u feature=0x%02x function=0x%02x",
+		__entry->dev_id, __entry->feature, __entry->function)
+);
+
+TRACE_EVENT(g502_cmd_complete,
+	TP_PROTO(unsigned int dev_id, u8 feature, u8 function, u8 sw_id,
+		int status, s64 latency_ns),
+	TP_ARGS(dev_id, feature, function, sw_id, status, latency_ns),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, dev_id)
+		__field(u8, feature)
+		__field(u8, function)
+		__field(u8, sw_id)
+		__field(int, status)
+		__field(s64, latency_ns)
+	),
+
+	TP_fast_assign(
+		__entry->dev_id = dev_id;
+		__entry->feature = feature;
+		__entry->function = function;
+		__entry->sw_id = sw_id;
+		__entry->status = status;
+		__entry->latency_ns = latency_ns;
+	),
+
+	TP_printk("dev=%u feature=0x%02x function=0x%02x sw_id=%u status=%d latency=%lldns",
+		__entry->dev_id, __entry->feature, __entry->function,
+		__entry->sw_id, __entry->status, __entry->latency_ns)
+);
+
+TRACE_EVENT(g502_raw_event,
+	TP_PROTO(unsigned int dev_id, unsigned int report_id, int size),
+	TP_ARGS(dev_id, report_id, size),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, dev_id)
+		__field(unsigned int, report_id)
+		__field(int, size)
+	),
+
+	TP_fast_assign(
+		__entry->dev_id = dev_id;
+		__entry->report_id = report_id;
+		__entry->size = size;
+	),
+
+	TP_printk("dev=%u report_id=0x%02x size=%d",
+		__entry->dev_id, __entry->report_id, __entry->size)
+);
+
+TRACE_EVENT(g502_reply_dropped,
+	TP_PROTO(unsigned int dev_id, u8 feature, u8 funcindex_clientid),
+	TP_ARGS(dev_id, feature, funcindex_clientid),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, dev_id)
+		__field(u8, feature)
+		__field(u8, funcindex_clientid)
+	),
+
+	TP_fast_assign(
+		__entry->dev_id = dev_id;
+		__entry->feature = feature;
+		__entry->funcindex_clientid = funcindex_clientid;
+	),
+
+	TP_printk("dev=%u feature=0x%02x function=0x%02x sw_id=%u",
+		__entry->dev_id, __entry->feature,
+		__entry->funcindex_clientid & 0xf0,
+		__entry->funcindex_clientid & 0x0f)
+);
+
+TRACE_EVENT(g502_profile_switch,
+	TP_PROTO(unsigned int dev_id, int from, int to, u16 report_rate, u16 dpi),
+	TP_ARGS(dev_id, from, to, report_rate, dpi),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, dev_id)
+		__field(int, from)
+		__field(int, to)
+		__field(u16, report_rate)
+		__field(u16, dpi)
+	),
+
+	TP_fast_assign(
+		__entry->dev_id = dev_id;
+		__entry->from = from;
+		__entry->to = to;
+		__entry->report_rate = report_rate;
+		__entry->dpi = dpi;
+	),
+
+	TP_printk("dev=%u profile %d -> %d report_rate=%u dpi=%u",
+		__entry->dev_id, __entry->from, __entry->to,
+		__entry->report_rate, __entry->dpi)
+);
+
+#endif /* G502_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE g502_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,196 @@
+/* SPDX-License-Identifier: GPL-2.0-only WITH Linux-syscall-note */
+
+#ifndef _UAPI_G502_H
+#define _UAPI_G502_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * /dev/g502-N, one per mouse.
+ *
+ * mmap() it read-only to get the event ring: a struct g502_ring_header
+ * followed, at @data_offset, by @nr_records struct g502_ring_record.
+ * The driver is the only writer. Record number n lives in slot
+ * n % @nr_records, and @head is the number of records written so far.
+ * A reader keeps its own tail. When @head - tail > @nr_records the
+ * reader fell behind, and the records in between are lost.
+ *
+ * The slot's @seq is written last, as n + 1. Read it with acquire
+ * semantics, copy the record, then check @seq again. If it changed, the
+ * slot was overwritten while you were copying it.
+ *
+ * poll() reports EPOLLIN when records were added since that file's
+ * previous poll, and EPOLLPRI when a profile switch was confirmed since.
+ */
+
+#define G502_RING_VERSION           1
+#define G502_RING_NR_RECORDS        1024
+#define G502_RING_DATA_OFFSET       4096
+
+struct g502_ring_header {
+	__u32 version;
+	__u32 nr_records;
+	__u32 record_size;
+	__u32 data_offset;
+	__u32 head;
+	__u32 reserved[11];
+};
+
+enum g502_record_type {
+	G502_REC_REPORT = 1,    /* HID++ report from the device, @payload is all of it */
+	G502_REC_CMD,           /* A command finished, @payload is the request, @value the latency in us */
+	G502_REC_PROFILE,       /* Profile switch, @value is the new index */
+	G502_REC_PROFILE_DONE,  /* The device acked the switch to profile @value, or failed */
+};
+
+struct g502_ring_record {
+	__u32 seq;
+	__u16 type;             /* enum g502_record_type */
+	__u16 len;              /* Of @payload */
+	__u64 timestamp_ns;     /* CLOCK_MONOTONIC */
+	__u8 feature;           /* HID++ feature index */
+	__u8 function;          /* HID++ function, in the high nibble */
+	__s16 status;           /* 0 or -errno, G502_REC_CMD and G502_REC_PROFILE_DONE */
+	__u32 value;
+	__u8 payload[20];
+	__u32 reserved;
+};
+
+/*
+ * Profile set, for G502_IOC_{GET,SET}_PROFILES.
+ *
+ * SET validates every profile before touching any of them. It replaces
+ * profiles 0..@nr_profiles - 1, switches to @active unless that is
+ * G502_KEEP_ACTIVE, and pushes the active profile to the device. It
+ * returns once the device acked it. The other profiles are only stored.
+ *
+ * A report rate of 0 and LEDs set to G502_LED_KEEP are left as the
+ * device has them. @period_ms 0 is the default period, @brightness 0
+ * full brightness. The DPI LED (zone 0) dims with the DPI stage when
+ * its effect is FIXED.
+ * @dpi[@dpi_stage] is the DPI the profile starts with, the DPI buttons
+ * step through the stages from there and the stage they leave it at is
+ * stored back. @shift_dpi is used while DPI_SHIFT is held, 0 for none.
+ * On-board profiles leave the DPI buttons to the mouse.
+ *
+ * @buttons is indexed by button bit, i.e. HID button usage - 1. On the
+ * G502 the DPI shift, down and up buttons (bits 5, 6 and 7) default to
+ * DPI_SHIFT, DPI_DOWN and DPI_UP, the G6 and tilt buttons (bits 8, 9
+ * and 10) to profile cycling and horizontal scrolling, everything else
+ * to DEFAULT.
+ */
+#define G502_PROFILES_VERSION       2
+#define G502_NR_PROFILES            5
+#define G502_NR_DPI_STAGES          5
+#define G502_NR_LED_ZONES           2
+#define G502_NR_BUTTONS             16
+#define G502_KEEP_ACTIVE            0xff
+
+enum g502_button_type {
+	G502_BUTTON_DEFAULT = 0,        /* Whatever the mouse reports */
+	G502_BUTTON_DISABLED,           /* Nothing at all */
+	G502_BUTTON_KEY,                /* EV_KEY @code, a keyboard key or BTN_LEFT..BTN_TASK */
+	G502_BUTTON_PROFILE_NEXT,       /* Cycle to the next profile */
+	G502_BUTTON_HWHEEL,             /* (__s16)@code horizontal wheel clicks */
+	G502_BUTTON_MACRO,              /* Play macro @code, see below */
+	G502_BUTTON_DPI_UP,             /* Next DPI stage, stops at the last one */
+	G502_BUTTON_DPI_DOWN,           /* Previous DPI stage, stops at the first one */
+	G502_BUTTON_DPI_SHIFT,          /* @shift_dpi while held */
+	G502_BUTTON_TYPE_NR
+};
+
+enum g502_led_effect {
+	G502_LED_KEEP = 0,              /* Whatever the zone shows */
+	G502_LED_OFF,
+	G502_LED_FIXED,                 /* @rgb */
+	G502_LED_BREATHING,             /* @rgb fading in and out every @period_ms */
+	G502_LED_CYCLE,                 /* Through every colour every @period_ms */
+	G502_LED_EFFECT_NR
+};
+
+#define G502_LED_PERIOD_MIN_MS      1000
+#define G502_LED_PERIOD_MAX_MS      20000
+
+struct g502_led {
+	__u8 effect;                    /* enum g502_led_effect */
+	__u8 brightness;                /* 1-100 %, 0 for 100 */
+	__u16 period_ms;
+	__u32 rgb;                      /* 0xRRGGBB */
+};
+
+struct g502_button {
+	__u8 type;                      /* enum g502_button_type */
+	__u8 reserved;
+	__u16 code;
+};
+
+struct g502_profile_desc {
+	__u16 report_rate;              /* Hz */
+	__u8 nr_dpi_stages;
+	__u8 dpi_stage;
+	__u16 dpi[G502_NR_DPI_STAGES];
+	__u16 shift_dpi;
+	struct g502_led leds[G502_NR_LED_ZONES]; /* Primary then logo */
+	struct g502_button buttons[G502_NR_BUTTONS];
+};
+
+struct g502_profiles {
+	__u32 version;                  /* G502_PROFILES_VERSION */
+	__u8 nr_profiles;
+	__u8 active;
+	__u16 reserved;
+	struct g502_profile_desc profiles[G502_NR_PROFILES];
+};
+
+/*
+ * Macros, for G502_IOC_SET_MACRO and G502_BUTTON_MACRO buttons.
+ *
+ * Each step presses or releases @code (or does nothing, for WAIT), then
+ * waits @delay_us before the next one. Keys still down at the end are
+ * released. Macros play through the mouse's input device, one at a time:
+ * a trigger while another one plays is queued and played in order, once
+ * the queue is full further triggers are dropped. Uploading macro @index
+ * while it plays ends it there, the queue goes on and triggers queued for
+ * @index play the new version. @nr_steps 0 deletes macro @index.
+ */
+#define G502_NR_MACROS              8
+#define G502_MACRO_MAX_STEPS        64
+#define G502_MACRO_MAX_DELAY_US     10000000
+
+enum g502_macro_action {
+	G502_MACRO_KEY_DOWN = 1,
+	G502_MACRO_KEY_UP,
+	G502_MACRO_WAIT,
+};
+
+struct g502_macro_step {
+	__u8 action;                    /* enum g502_macro_action */
+	__u8 reserved;
+	__u16 code;                     /* EV_KEY code, same ones as G502_BUTTON_KEY */
+	__u32 delay_us;
+};
+
+struct g502_macro {
+	__u8 index;
+	__u8 nr_steps;
+	__u16 reserved;
+	struct g502_macro_step steps[G502_MACRO_MAX_STEPS];
+};
+
+/*
+ * G502_IOC_SELECT_PROFILE switches to profile *arg and returns right away.
+ * Once the device acked it, or failed to, a G502_REC_PROFILE_DONE record
+ * is added, poll() reports EPOLLPRI and the HID device sends a change
+ * uevent with G502_PROFILE and G502_STATUS. Switches in quick succession
+ * collapse, only the last one is applied and confirmed. -EAGAIN until the
+ * mouse is initialized.
+ */
+
+#define G502_IOC_MAGIC              'G'
+#define G502_IOC_GET_PROFILES       _IOR(G502_IOC_MAGIC, 0x01, struct g502_profiles)
+#define G502_IOC_SET_PROFILES       _IOW(G502_IOC_MAGIC, 0x02, struct g502_profiles)
+#define G502_IOC_SET_MACRO          _IOW(G502_IOC_MAGIC, 0x03, struct g502_macro)
+#define G502_IOC_SELECT_PROFILE     _IOW(G502_IOC_MAGIC, 0x04, __u32)
+
+#endif /* _UAPI_G502_H */